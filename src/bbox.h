@@ -36,9 +36,6 @@ struct Triangle {
 	int v[3]; //!< holds indices to the three vertices of the triangle (indexes in the `vertices' array in the Mesh)
 	int n[3]; //!< holds indices to the three normals of the triangle (indexes in the `normals' array)
 	int t[3]; //!< holds indices to the three texture coordinates of the triangle (indexes in the `uvs' array)
-	Vector gnormal; //!< The geometric normal of the mesh (AB ^ AC, normalized)
-	Vector AB, AC, ABcrossAC; //!< precomputed AB, AC and AB^AC
-	Vector dNdx, dNdy;
 };
 // the C vertex of triangle with index 5 is:
 // mesh.vertices[mesh.triangles[5].v[2]];
@@ -89,6 +86,12 @@ struct BBox {
 		vmin.y = min(vmin.y, vec.y); vmax.y = max(vmax.y, vec.y);
 		vmin.z = min(vmin.z, vec.z); vmax.z = max(vmax.z, vec.z);
 	}
+	/// returns the surface area of the box (used in SAH computations)
+	inline double area() const
+	{
+		Vector d = vmax - vmin;
+		return 2 * (d.x * d.y + d.x * d.z + d.y * d.z);
+	}
 	/// Checks if a point is inside the bounding box (borders-inclusive)
 	inline bool inside(const Vector& v) const
 	{
@@ -174,6 +177,22 @@ struct BBox {
 		}
 		return minDist;
 	}
+	/// Clips a ray against the box (the "slabs" method), yielding the parametric interval [tmin, tmax] along the ray,
+	/// which is inside the box (the interval never extends behind the ray's start).
+	/// @returns false if the ray misses the box altogether.
+	inline bool clipRay(const RRay& ray, double& tmin, double& tmax) const
+	{
+		tmin = 0;
+		tmax = INF;
+		for (int dim = 0; dim < 3; dim++) {
+			double t0 = (vmin[dim] - ray.start[dim]) * ray.rdir[dim];
+			double t1 = (vmax[dim] - ray.start[dim]) * ray.rdir[dim];
+			if (t0 > t1) std::swap(t0, t1);
+			tmin = max(tmin, t0);
+			tmax = min(tmax, t1);
+		}
+		return tmin <= tmax;
+	}
 	/// Check whether the box intersects a triangle (all three cases)
 	inline bool intersectTriangle(const Vector& A, const Vector& B, const Vector& C) const
 	{
@@ -217,13 +217,12 @@ bool Bitmap::saveBMP(const char* filename)
 	if (!fp) return false;
 	BmpHeader hd;
 	BmpInfoHeader hi;
-	char xx[VFB_MAX_SIZE * 3];
-
 
 	// fill in the header:
 	int rowsz = width * 3;
 	if (rowsz % 4)
 		rowsz += 4 - (rowsz % 4); // each row in of the image should be filled with zeroes to the next multiple-of-four boundary
+	std::vector<char> xx(rowsz, 0);
 	hd.fs = rowsz * height + 54; //std image size
 	hd.lzero = 0;
 	hd.bfImgOffset = 54;
@@ -246,7 +245,7 @@ bool Bitmap::saveBMP(const char* filename)
 			xx[x * 3 + 1] = (0xff00   & t) >> 8;
 			xx[x * 3 + 2] = (0xff0000 & t) >> 16;
 		}
-		fwrite(xx, rowsz, 1, fp);
+		fwrite(&xx[0], rowsz, 1, fp);
 	}
 	fclose(fp);
 	return true;
@@ -360,3 +359,120 @@ void Bitmap::decompressGamma(float gamma)
 		return powf(x, gamma);
 	});
 }
+
+/// the OpenEXR part of an ImageRowReader
+struct EXRRowState {
+	Imf::RgbaInputFile file;
+	Imath::Box2i dw;
+	std::vector<Imf::Rgba> row;
+	EXRRowState(const char* filename): file(filename) {}
+};
+
+ImageRowReader::ImageRowReader()
+{
+	width = height = 0;
+	fp = NULL;
+	exr = NULL;
+}
+
+ImageRowReader::~ImageRowReader()
+{
+	close();
+}
+
+void ImageRowReader::close(void)
+{
+	if (fp) fclose(fp);
+	fp = NULL;
+	delete exr;
+	exr = NULL;
+	width = height = 0;
+}
+
+bool ImageRowReader::open(const char* filename)
+{
+	close();
+	if (extensionUpper(filename) == "BMP") return openBMP(filename);
+	if (extensionUpper(filename) == "EXR") return openEXR(filename);
+	return false;
+}
+
+bool ImageRowReader::openBMP(const char* filename)
+{
+	// the same format checks as in Bitmap::loadBMP():
+	BmpHeader hd;
+	BmpInfoHeader hi;
+	unsigned short sign;
+	fp = fopen(filename, "rb");
+	if (!fp) return false;
+	if (!fread(&sign, 2, 1, fp) || sign != BM_MAGIC || !fread(&hd, sizeof(hd), 1, fp) || !fread(&hi, sizeof(hi), 1, fp) ||
+	    !(hi.bitsperpixel == 8 || hi.bitsperpixel == 24 || hi.bitsperpixel == 32) || hi.channels != 1 ||
+	    hi.x <= 0 || hi.y <= 0) {
+		close();
+		return false;
+	}
+	if (hi.bitsperpixel == 8) {
+		int colors = hi.colors ? std::min(int(hi.colors), 256) : 256;
+		for (int i = 0; i < colors; i++) {
+			unsigned temp;
+			if (!fread(&temp, 1, 4, fp)) {
+				close();
+				return false;
+			}
+			palette[i] = Color(temp);
+		}
+	}
+	width = hi.x;
+	height = hi.y;
+	bitsPerPixel = hi.bitsperpixel;
+	rowSize = (width * (bitsPerPixel / 8) + 3) / 4 * 4;
+	pixelsOffset = hd.bfImgOffset;
+	rowData.resize(rowSize);
+	return true;
+}
+
+bool ImageRowReader::openEXR(const char* filename)
+{
+	try {
+		exr = new EXRRowState(filename);
+		exr->dw = exr->file.dataWindow();
+		width  = exr->dw.max.x - exr->dw.min.x + 1;
+		height = exr->dw.max.y - exr->dw.min.y + 1;
+		exr->row.resize(width);
+		// all scanlines go to the same row buffer (yStride = 0):
+		exr->file.setFrameBuffer(&exr->row[0] - exr->dw.min.x, 1, 0);
+		return true;
+	}
+	catch (Iex::BaseExc ex) {
+		close();
+		return false;
+	}
+}
+
+bool ImageRowReader::readRow(int y, Color* row)
+{
+	if (y < 0 || y >= height) return false;
+	if (fp) {
+		// bitmaps are saved in inverted y
+		if (fseek(fp, pixelsOffset + long(height - 1 - y) * rowSize, SEEK_SET) ||
+		    fread(&rowData[0], 1, rowSize, fp) != size_t(rowSize)) return false;
+		int k = bitsPerPixel / 8;
+		for (int i = 0; i < width; i++) {
+			const unsigned char* xx = &rowData[i * k];
+			row[i] = bitsPerPixel > 8 ? Color(xx[2] / 255.0f, xx[1] / 255.0f, xx[0] / 255.0f) : palette[xx[0]];
+		}
+		return true;
+	}
+	if (exr) {
+		try {
+			exr->file.readPixels(exr->dw.min.y + y, exr->dw.min.y + y);
+		}
+		catch (Iex::BaseExc ex) {
+			return false;
+		}
+		for (int i = 0; i < width; i++)
+			row[i] = Color(exr->row[i].r, exr->row[i].g, exr->row[i].b);
+		return true;
+	}
+	return false;
+}
@@ -25,6 +25,8 @@
 #define __BITMAP_H__
 
 #include <functional>
+#include <stdio.h>
+#include <vector>
 #include "color.h"
 
 /// @brief a class that represents a bitmap (2d array of colors), e.g. a image
@@ -65,4 +67,30 @@ public:
 	void differentiate();
 };
 
+/// @brief reads an image (BMP or EXR) one row at a time, without loading all of it in memory
+class ImageRowReader {
+	int width, height;
+	// BMP:
+	FILE* fp;
+	long pixelsOffset;
+	int bitsPerPixel, rowSize;
+	Color palette[256];
+	std::vector<unsigned char> rowData;
+	// EXR (the OpenEXR objects are kept out of this header):
+	struct EXRRowState* exr;
+	
+	bool openBMP(const char* filename);
+	bool openEXR(const char* filename);
+	ImageRowReader(const ImageRowReader&);
+	ImageRowReader& operator = (const ImageRowReader&);
+public:
+	ImageRowReader();
+	~ImageRowReader();
+	bool open(const char* filename); //!< opens an image (the format is detected from extension). Returns false in the case of an error
+	void close(void);
+	int getWidth(void) const { return width; }
+	int getHeight(void) const { return height; }
+	bool readRow(int y, Color* row); //!< reads the y-th row (from the top) in row[0..width-1]
+};
+
 #endif // __BITMAP_H__
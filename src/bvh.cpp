@@ -0,0 +1,158 @@
+/***************************************************************************
+ *   Copyright (C) 2009-2015 by Veselin Georgiev, Slavomir Kaslev et al    *
+ *   admin@raytracing-bg.net                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+/**
+ * @File bvh.cpp
+ * @Brief Implementation of the BVH class.
+ */
+#include <algorithm>
+#include "bvh.h"
+#include "constants.h"
+
+using std::vector;
+
+static const int BVH_NUM_BINS = 16;
+static const int BVH_MAX_LEAF_ITEMS = 4;
+// below this depth, only median splits are done, which keeps the tree depth (and the traversal stack) bounded:
+static const int BVH_MAX_SAH_DEPTH = 32;
+
+static inline void addBox(BBox& target, const BBox& box)
+{
+	target.add(box.vmin);
+	target.add(box.vmax);
+}
+
+void BVH::build(const vector<BBox>& boxes)
+{
+	nodes.clear();
+	items.resize(boxes.size());
+	if (boxes.empty()) return;
+	vector<Vector> centers(boxes.size());
+	for (int i = 0; i < (int) boxes.size(); i++) {
+		items[i] = i;
+		centers[i] = (boxes[i].vmin + boxes[i].vmax) * 0.5;
+	}
+	nodes.reserve(2 * boxes.size());
+	nodes.push_back(BVHNode());
+	build(0, 0, int(items.size()), boxes, centers, 0);
+}
+
+void BVH::build(int node, int begin, int end, const vector<BBox>& boxes, vector<Vector>& centers, int depth)
+{
+	BBox bbox, centerBBox;
+	bbox.makeEmpty();
+	centerBBox.makeEmpty();
+	for (int i = begin; i < end; i++) {
+		addBox(bbox, boxes[items[i]]);
+		centerBBox.add(centers[items[i]]);
+	}
+	nodes[node].bbox = bbox;
+	int count = end - begin;
+	
+	// split along the axis, where the item centers are most spread out:
+	Vector extent = centerBBox.vmax - centerBBox.vmin;
+	int axis = 0;
+	if (extent.y > extent[axis]) axis = 1;
+	if (extent.z > extent[axis]) axis = 2;
+	
+	if (count <= 1) {
+		nodes[node].first = begin;
+		nodes[node].count = count;
+		return;
+	}
+	
+	// bin the item centers and find the cheapest split between bins (SAH):
+	double binScale = extent[axis] > 0 ? BVH_NUM_BINS / extent[axis] : 0;
+	double axisMin = centerBBox.vmin[axis];
+	auto binOf = [&] (int item) {
+		return std::min(BVH_NUM_BINS - 1, int((centers[item][axis] - axisMin) * binScale));
+	};
+	BBox binBBox[BVH_NUM_BINS];
+	int binCount[BVH_NUM_BINS] = { 0 };
+	for (int i = 0; i < BVH_NUM_BINS; i++) binBBox[i].makeEmpty();
+	for (int i = begin; i < end; i++) {
+		int bin = binOf(items[i]);
+		binCount[bin]++;
+		addBox(binBBox[bin], boxes[items[i]]);
+	}
+	double rightArea[BVH_NUM_BINS];
+	BBox accum;
+	accum.makeEmpty();
+	for (int i = BVH_NUM_BINS - 1; i > 0; i--) {
+		addBox(accum, binBBox[i]);
+		rightArea[i] = accum.area(); // (only used if there are items to the right)
+	}
+	double bestCost = INF;
+	int bestSplit = -1, leftCount = 0;
+	accum.makeEmpty();
+	for (int i = 1; i < BVH_NUM_BINS; i++) {
+		addBox(accum, binBBox[i - 1]);
+		leftCount += binCount[i - 1];
+		int rightCount = count - leftCount;
+		if (leftCount == 0 || rightCount == 0) continue;
+		double cost = leftCount * accum.area() + rightCount * rightArea[i];
+		if (cost < bestCost) {
+			bestCost = cost;
+			bestSplit = i;
+		}
+	}
+	
+	// is a leaf cheaper (in SAH terms) than splitting?
+	double leafCost = count * bbox.area();
+	if (count <= BVH_MAX_LEAF_ITEMS && (bestSplit == -1 || bestCost >= leafCost)) {
+		nodes[node].first = begin;
+		nodes[node].count = count;
+		return;
+	}
+	
+	int mid;
+	if (bestSplit != -1 && depth < BVH_MAX_SAH_DEPTH) {
+		mid = int(std::partition(items.begin() + begin, items.begin() + end,
+				[&] (int item) { return binOf(item) < bestSplit; }) - items.begin());
+	} else {
+		// all centers fell in one bin (clumped items), or the tree got too deep; split them in halves:
+		mid = (begin + end) / 2;
+		std::nth_element(items.begin() + begin, items.begin() + mid, items.begin() + end,
+				[&] (int a, int b) { return centers[a][axis] < centers[b][axis]; });
+	}
+	
+	int children = int(nodes.size());
+	nodes.push_back(BVHNode());
+	nodes.push_back(BVHNode());
+	nodes[node].first = children;
+	nodes[node].count = 0;
+	build(children, begin, mid, boxes, centers, depth + 1);
+	build(children + 1, mid, end, boxes, centers, depth + 1);
+}
+
+void BVH::refit(const vector<BBox>& boxes)
+{
+	// children are always stored after their parent, so a reverse sweep updates them first:
+	for (int i = int(nodes.size()) - 1; i >= 0; i--) {
+		BVHNode& node = nodes[i];
+		node.bbox.makeEmpty();
+		if (node.count) {
+			for (int j = 0; j < node.count; j++)
+				addBox(node.bbox, boxes[items[node.first + j]]);
+		} else {
+			addBox(node.bbox, nodes[node.first].bbox);
+			addBox(node.bbox, nodes[node.first + 1].bbox);
+		}
+	}
+}
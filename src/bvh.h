@@ -0,0 +1,162 @@
+/***************************************************************************
+ *   Copyright (C) 2009-2015 by Veselin Georgiev, Slavomir Kaslev et al    *
+ *   admin@raytracing-bg.net                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+/**
+ * @File bvh.h
+ * @Brief Contains the BVH class (a bounding volume hierarchy over arbitrary boxed items).
+ */
+#ifndef __BVH_H__
+#define __BVH_H__
+
+#include <vector>
+#include "bbox.h"
+#include "packet.h"
+
+/**
+ * @brief A bounding volume hierarchy over a set of items, each given by its bounding box.
+ *
+ * The BVH only knows the boxes of the items; what an item is, and how it is intersected, is up to the
+ * caller (see traverse()). The item indices are those in the array, given to build().
+ */
+class BVH {
+	struct BVHNode {
+		BBox bbox;
+		int first; //!< inner nodes: index of the first child (the second follows it). Leaves: first index in `items'
+		int count; //!< number of items in a leaf; 0 for inner nodes
+	};
+	std::vector<BVHNode> nodes;
+	std::vector<int> items;
+	
+	void build(int node, int begin, int end, const std::vector<BBox>& boxes, std::vector<Vector>& centers, int depth);
+public:
+	/// builds the hierarchy over the given boxes
+	void build(const std::vector<BBox>& boxes);
+	
+	/// recomputes the nodes' boxes, if the items have moved (the tree topology is preserved)
+	void refit(const std::vector<BBox>& boxes);
+	
+	int getNumNodes() const { return int(nodes.size()); }
+	size_t memoryUsage() const { return nodes.size() * sizeof(BVHNode) + items.size() * sizeof(int); }
+	
+	/**
+	 * Visits all items, whose boxes are hit by the ray, closer than maxDist, roughly in front-to-back order.
+	 *
+	 * @param intersectItem - a callable with a signature bool(int item, double& maxDist). It may decrease maxDist
+	 *                        (e.g., when a closer hit is found), which culls the remaining nodes further.
+	 *                        If it returns true, the traversal is stopped immediately (e.g., when any hit suffices).
+	 * @returns true if the traversal was stopped by intersectItem.
+	 */
+	template<typename ItemFunc>
+	bool traverse(const RRay& ray, double& maxDist, ItemFunc intersectItem) const
+	{
+		if (nodes.empty()) return false;
+		int stack[64]; // the tree depth is bounded by the builder (see BVH_MAX_SAH_DEPTH)
+		int stackSize = 0;
+		int nodeIdx = 0;
+		double tmin, tmax;
+		if (!nodes[0].bbox.clipRay(ray, tmin, tmax) || tmin > maxDist) return false;
+		while (true) {
+			const BVHNode& node = nodes[nodeIdx];
+			if (node.count) {
+				for (int i = 0; i < node.count; i++)
+					if (intersectItem(items[node.first + i], maxDist)) return true;
+			} else {
+				double tmin0, tmax0, tmin1, tmax1;
+				bool hit0 = nodes[node.first    ].bbox.clipRay(ray, tmin0, tmax0) && tmin0 <= maxDist;
+				bool hit1 = nodes[node.first + 1].bbox.clipRay(ray, tmin1, tmax1) && tmin1 <= maxDist;
+				if (hit0 && hit1) {
+					// visit the nearer child first:
+					bool firstIsNearer = tmin0 <= tmin1;
+					stack[stackSize++] = node.first + (firstIsNearer ? 1 : 0);
+					nodeIdx = node.first + (firstIsNearer ? 0 : 1);
+					continue;
+				}
+				if (hit0 || hit1) {
+					nodeIdx = node.first + (hit0 ? 0 : 1);
+					continue;
+				}
+			}
+			// pop the next node, which is still in reach:
+			while (true) {
+				if (stackSize == 0) return false;
+				nodeIdx = stack[--stackSize];
+				if (nodes[nodeIdx].bbox.clipRay(ray, tmin, tmax) && tmin <= maxDist) break;
+			}
+		}
+	}
+	
+	/**
+	 * Same as traverse(), but for the rays of a packet, given in the mask.
+	 *
+	 * @param maxDist       - per ray maximum distances; they may be decreased by intersectItem.
+	 * @param intersectItem - a callable with a signature void(int item, int mask), where mask holds the rays
+	 *                        which hit the leaf, containing the item.
+	 */
+	template<typename ItemFunc>
+	void traversePacket(const RayPacket& packet, int mask, const double maxDist[], ItemFunc intersectItem) const
+	{
+		if (nodes.empty()) return;
+		struct StackEntry {
+			int node, mask;
+		};
+		StackEntry stack[64];
+		int stackSize = 0;
+		int nodeIdx = 0;
+		__m128d tmin[2], tmax[2];
+		mask = packet.clipBox(nodes[0].bbox, mask, maxDist, tmin, tmax);
+		if (!mask) return;
+		while (true) {
+			const BVHNode& node = nodes[nodeIdx];
+			if (node.count) {
+				for (int i = 0; i < node.count; i++)
+					intersectItem(items[node.first + i], mask);
+			} else {
+				__m128d tmin0[2], tmax0[2], tmin1[2], tmax1[2];
+				int mask0 = packet.clipBox(nodes[node.first    ].bbox, mask, maxDist, tmin0, tmax0);
+				int mask1 = packet.clipBox(nodes[node.first + 1].bbox, mask, maxDist, tmin1, tmax1);
+				if (mask0 && mask1) {
+					// visit the child, which is nearer for most of the rays, first:
+					int nearer0 = (_mm_movemask_pd(_mm_cmple_pd(tmin0[0], tmin1[0]))
+					            | (_mm_movemask_pd(_mm_cmple_pd(tmin0[1], tmin1[1])) << 2)) & mask0 & mask1;
+					bool firstIsNearer = 2 * packetRayCount(nearer0) >= packetRayCount(mask0 & mask1);
+					stack[stackSize].node = node.first + (firstIsNearer ? 1 : 0);
+					stack[stackSize++].mask = firstIsNearer ? mask1 : mask0;
+					nodeIdx = node.first + (firstIsNearer ? 0 : 1);
+					mask = firstIsNearer ? mask0 : mask1;
+					continue;
+				}
+				if (mask0 || mask1) {
+					nodeIdx = node.first + (mask0 ? 0 : 1);
+					mask = mask0 ? mask0 : mask1;
+					continue;
+				}
+			}
+			// pop the next node, which is still in reach for some of the rays:
+			while (true) {
+				if (stackSize == 0) return;
+				StackEntry& entry = stack[--stackSize];
+				nodeIdx = entry.node;
+				mask = packet.clipBox(nodes[nodeIdx].bbox, entry.mask, maxDist, tmin, tmax);
+				if (mask) break;
+			}
+		}
+	}
+};
+
+#endif // __BVH_H__
@@ -25,7 +25,6 @@
 #define __CONSTANTS_H__
 
 
-#define VFB_MAX_SIZE 1920
 #define RESX 640
 #define RESY 480
 #define PI 3.141592653589793238
@@ -41,4 +40,9 @@
 #define MAX_TREE_DEPTH 64
 #define TRIANGLES_PER_LEAF 20
 
+// Cost model for the surface-area-heuristic (SAH) KD tree builder:
+#define SAH_TRAVERSAL_COST 1.0    // relative cost of a single inner node traversal step
+#define SAH_INTERSECTION_COST 1.5 // relative cost of a single ray-triangle test
+#define SAH_EMPTY_BONUS 0.2       // splits that cut off empty space get this much cheaper
+
 #endif // __CONSTANTS_H__
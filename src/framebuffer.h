@@ -0,0 +1,95 @@
+/***************************************************************************
+ *   Copyright (C) 2009-2015 by Veselin Georgiev, Slavomir Kaslev et al    *
+ *   admin@raytracing-bg.net                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+/**
+ * @File framebuffer.h
+ * @Brief A dynamically sized, tiled framebuffer.
+ */
+#ifndef __FRAMEBUFFER_H__
+#define __FRAMEBUFFER_H__
+
+#include "color.h"
+
+#define FB_TILE_BITS 4 //!< the framebuffer tiles are (1 << FB_TILE_BITS) pixels square (i.e., 16x16)
+
+/**
+ * @brief A 2D array of pixels (or per-pixel flags), sized at runtime and stored tile-major.
+ *
+ * The image is split into square tiles of 16x16 pixels; the pixels of a tile are contiguous in memory
+ * (stored row by row), and so are the tiles of a row of tiles. The buckets are (mostly) aligned on the
+ * tiles, so a render thread writes to a few small, contiguous memory ranges, and not to a long stride of
+ * rows, which are shared (via cache lines) with the neighbouring buckets. The edge tiles are padded.
+ */
+template <typename T>
+class TiledBuffer {
+	T* data;
+	int width, height;
+	int tilesX, tilesY;
+	
+	TiledBuffer(const TiledBuffer&);
+	TiledBuffer& operator = (const TiledBuffer&);
+public:
+	TiledBuffer(): data(NULL), width(0), height(0), tilesX(0), tilesY(0) {}
+	~TiledBuffer() { delete[] data; }
+	
+	/// (re)allocates the buffer for a frame of the given size (the old contents are lost)
+	void init(int width, int height)
+	{
+		delete[] data;
+		this->width = width;
+		this->height = height;
+		const int TILE = 1 << FB_TILE_BITS;
+		tilesX = (width + TILE - 1) >> FB_TILE_BITS;
+		tilesY = (height + TILE - 1) >> FB_TILE_BITS;
+		data = new T[size_t(tilesX) * tilesY * TILE * TILE]();
+	}
+	
+	/// sets all pixels (including the padding) to the given value
+	void fill(const T& value)
+	{
+		size_t n = size_t(tilesX) * tilesY << (2 * FB_TILE_BITS);
+		for (size_t i = 0; i < n; i++)
+			data[i] = value;
+	}
+	
+	int getWidth(void) const { return width; }
+	int getHeight(void) const { return height; }
+	
+	inline T& at(int x, int y)
+	{
+		return data[offset(x, y)];
+	}
+	
+	inline const T& at(int x, int y) const
+	{
+		return data[offset(x, y)];
+	}
+	
+	/// the index of the pixel (x, y) in the data[] array
+	inline size_t offset(int x, int y) const
+	{
+		const int MASK = (1 << FB_TILE_BITS) - 1;
+		size_t tile = size_t(y >> FB_TILE_BITS) * tilesX + (x >> FB_TILE_BITS);
+		return (tile << (2 * FB_TILE_BITS)) + ((y & MASK) << FB_TILE_BITS) + (x & MASK);
+	}
+};
+
+typedef TiledBuffer<Color> FrameBuffer;
+
+#endif // __FRAMEBUFFER_H__
@@ -26,7 +26,30 @@
 #include <algorithm>
 using std::vector;
 
+int Geometry::findAllHits(const Ray& ray, HitRecord hits[], int maxHits)
+{
+	Ray next = ray;
+	double offset = 0; // where `next' starts, along `ray'
+	int n = 0;
+	while (n < maxHits && findHit(next, INF, hits[n])) {
+		HitRecord& hit = hits[n++];
+		offset += hit.distance;
+		hit.distance = offset;
+		offset += 1e-6;
+		next.start = ray.start + ray.dir * offset;
+	}
+	return n;
+}
+
 bool Plane::intersect(const Ray& ray, IntersectionInfo& info)
+{
+	HitRecord hit;
+	if (!findHit(ray, INF, hit)) return false;
+	computeSurface(ray, hit, info);
+	return true;
+}
+
+bool Plane::findHit(const Ray& ray, double maxDist, HitRecord& hit)
 {
 	if (ray.start.y > this->y && ray.dir.y >= 0)
 		return false;
@@ -38,19 +61,59 @@ bool Plane::intersect(const Ray& ray, IntersectionInfo& info)
 	// ray.dir.y = -1
 	// (1 - 6) / -1 = -5 / -1 = 5
 	double scaleFactor = (this->y - ray.start.y) / ray.dir.y;
-	info.ip = ray.start + ray.dir * scaleFactor;
-	info.distance = scaleFactor;
+	Vector ip = ray.start + ray.dir * scaleFactor;
+	if (fabs(ip.x) > limit || fabs(ip.z) > limit || scaleFactor >= maxDist) return false;
+	hit.distance = scaleFactor;
+	return true;
+}
+
+void Plane::computeSurface(const Ray& ray, const HitRecord& hit, IntersectionInfo& info)
+{
+	info.ip = ray.start + ray.dir * hit.distance;
+	info.distance = hit.distance;
 	info.normal = Vector(0, ray.start.y > this->y ? 1 : -1, 0);
-	if (fabs(info.ip.x) > limit || fabs(info.ip.z) > limit) return false;
 	info.u = info.ip.x;
 	info.v = info.ip.z;
 	info.dNdx = Vector(1, 0, 0);
 	info.dNdy = Vector(0, 0, 1);
 	info.geom = this;
+}
+
+bool Plane::intersectAny(const Ray& ray, double maxDist)
+{
+	if (ray.start.y > this->y && ray.dir.y >= 0)
+		return false;
+	if (ray.start.y < this->y && ray.dir.y <= 0)
+		return false;
+	
+	double scaleFactor = (this->y - ray.start.y) / ray.dir.y;
+	if (scaleFactor >= maxDist) return false;
+	Vector ip = ray.start + ray.dir * scaleFactor;
+	return fabs(ip.x) <= limit && fabs(ip.z) <= limit;
+}
+
+int Plane::findAllHits(const Ray& ray, HitRecord hits[], int maxHits)
+{
+	return findHit(ray, INF, hits[0]) ? 1 : 0;
+}
+
+bool Plane::getBBox(BBox& bbox) const
+{
+	if (limit >= 1e99) return false;
+	bbox.vmin = Vector(-limit, y, -limit);
+	bbox.vmax = Vector(+limit, y, +limit);
 	return true;
 }
 
 bool Sphere::intersect(const Ray& ray, IntersectionInfo& info)
+{
+	HitRecord hit;
+	if (!findHit(ray, INF, hit)) return false;
+	computeSurface(ray, hit, info);
+	return true;
+}
+
+bool Sphere::findHit(const Ray& ray, double maxDist, HitRecord& hit)
 {
 	// H = ray.start - O
 	// p^2 * dir.length()^2 + p * 2 * dot(H, dir) + H.length()^2 - R^2 == 0
@@ -73,8 +136,15 @@ bool Sphere::intersect(const Ray& ray, IntersectionInfo& info)
 		p = p2;
 	else return false;
 	
-	info.distance = p;
-	info.ip = ray.start + ray.dir * p;
+	if (p >= maxDist) return false;
+	hit.distance = p;
+	return true;
+}
+
+void Sphere::computeSurface(const Ray& ray, const HitRecord& hit, IntersectionInfo& info)
+{
+	info.distance = hit.distance;
+	info.ip = ray.start + ray.dir * hit.distance;
 	info.normal = info.ip - O;
 	info.normal.normalize();
 	info.u = info.v = 0;
@@ -85,10 +155,49 @@ bool Sphere::intersect(const Ray& ray, IntersectionInfo& info)
 	info.u = (info.u + PI) / (2*PI);
 	info.v = -(info.v + PI/2) / (PI);
 	info.geom = this;
+}
+
+bool Sphere::intersectAny(const Ray& ray, double maxDist)
+{
+	Vector H = ray.start - O;
+	double B = 2 * dot(H, ray.dir);
+	double C = H.lengthSqr() - R*R;
+	double discr = B*B - 4*C;
+	if (discr < 0) return false;
+	
+	double p1 = (-B - sqrt(discr)) / 2;
+	double p2 = (-B + sqrt(discr)) / 2;
+	double p;
+	if (p1 > 0) p = p1;
+	else if (p2 > 0) p = p2;
+	else return false;
+	return p < maxDist;
+}
+
+int Sphere::findAllHits(const Ray& ray, HitRecord hits[], int maxHits)
+{
+	Vector H = ray.start - O;
+	double B = 2 * dot(H, ray.dir);
+	double C = H.lengthSqr() - R*R;
+	double discr = B*B - 4*C;
+	if (discr <= 0) return 0; // (a tangent ray doesn't cross the surface)
+	
+	double p1 = (-B - sqrt(discr)) / 2;
+	double p2 = (-B + sqrt(discr)) / 2;
+	int n = 0;
+	if (p1 > 0) hits[n++].distance = p1;
+	if (p2 > 0 && n < maxHits) hits[n++].distance = p2;
+	return n;
+}
+
+bool Sphere::getBBox(BBox& bbox) const
+{
+	bbox.vmin = O - Vector(R, R, R);
+	bbox.vmax = O + Vector(R, R, R);
 	return true;
 }
 
-bool Cube::intersectSide(double level, double start, double dir, const Ray& ray, const Vector& normal, IntersectionInfo& info)
+bool Cube::hitSide(double level, double start, double dir, const Ray& ray, double& distance, Vector& ip) const
 {
 	if (start > level && dir >= 0)
 		return false;
@@ -96,7 +205,7 @@ bool Cube::intersectSide(double level, double start, double dir, const Ray& ray,
 		return false;
 	
 	double scaleFactor = (level - start) / dir;
-	Vector ip = ray.start + ray.dir * scaleFactor;
+	ip = ray.start + ray.dir * scaleFactor;
 	if (ip.y > O.y + halfSide + 1e-6) return false;
 	if (ip.y < O.y - halfSide - 1e-6) return false;
 	
@@ -106,96 +215,262 @@ bool Cube::intersectSide(double level, double start, double dir, const Ray& ray,
 	if (ip.z > O.z + halfSide + 1e-6) return false;
 	if (ip.z < O.z - halfSide - 1e-6) return false;
 	
-	double distance = scaleFactor;
-	if (distance < info.distance) {
-		info.ip = ip;
-		info.distance = distance;
-		info.normal = normal;
-		if (normal.y == 0) {
-			info.u = info.ip.x + info.ip.z;
-			info.v = info.ip.y;
-		} else {
-			// top or bottom:
-			info.u = info.ip.x;
-			info.v = info.ip.z;
+	distance = scaleFactor;
+	return true;
+}
+
+bool Cube::intersect(const Ray& ray, IntersectionInfo& info)
+{
+	HitRecord hit;
+	if (!findHit(ray, INF, hit)) return false;
+	computeSurface(ray, hit, info);
+	return true;
+}
+
+/// the hit record's primitive is the side, which was hit: 2 * dim + (0 for the -dim side, 1 for the +dim side)
+bool Cube::findHit(const Ray& ray, double maxDist, HitRecord& hit)
+{
+	hit.distance = maxDist;
+	for (int dim = 0; dim < 3; dim++)
+		for (int side = -1; side <= 1; side += 2) {
+			double distance;
+			Vector ip;
+			if (hitSide(O[dim] + side * halfSide, ray.start[dim], ray.dir[dim], ray, distance, ip)
+			    && distance < hit.distance) {
+				hit.distance = distance;
+				hit.primitive = 2 * dim + (side > 0 ? 1 : 0);
+			}
 		}
-		info.geom = this;
-		return true;
+	return hit.distance < maxDist;
+}
+
+void Cube::computeSurface(const Ray& ray, const HitRecord& hit, IntersectionInfo& info)
+{
+	int dim = hit.primitive / 2;
+	info.ip = ray.start + ray.dir * hit.distance;
+	info.distance = hit.distance;
+	info.normal = Vector(0, 0, 0);
+	info.normal[dim] = (hit.primitive % 2) ? +1 : -1;
+	if (dim != 1) {
+		info.u = info.ip.x + info.ip.z;
+		info.v = info.ip.y;
+	} else {
+		// top or bottom:
+		info.u = info.ip.x;
+		info.v = info.ip.z;
 	}
+	info.geom = this;
+}
+
+bool Cube::intersectAny(const Ray& ray, double maxDist)
+{
+	for (int dim = 0; dim < 3; dim++)
+		for (int side = -1; side <= 1; side += 2) {
+			double distance;
+			Vector ip;
+			if (hitSide(O[dim] + side * halfSide, ray.start[dim], ray.dir[dim], ray, distance, ip) && distance < maxDist)
+				return true;
+		}
 	return false;
 }
 
-bool Cube::intersect(const Ray& ray, IntersectionInfo& info)
+/// the slabs method: the ray is inside the cube from the last entry into a slab, to the first exit from one
+int Cube::findAllHits(const Ray& ray, HitRecord hits[], int maxHits)
 {
-	info.distance = INF;
-	intersectSide(O.x - halfSide, ray.start.x, ray.dir.x, ray, Vector(-1, 0, 0), info);
-	intersectSide(O.x + halfSide, ray.start.x, ray.dir.x, ray, Vector(+1, 0, 0), info);
-	intersectSide(O.y - halfSide, ray.start.y, ray.dir.y, ray, Vector( 0,-1, 0), info);
-	intersectSide(O.y + halfSide, ray.start.y, ray.dir.y, ray, Vector( 0,+1, 0), info);
-	intersectSide(O.z - halfSide, ray.start.z, ray.dir.z, ray, Vector( 0, 0,-1), info);
-	intersectSide(O.z + halfSide, ray.start.z, ray.dir.z, ray, Vector( 0, 0,+1), info);
-	
-	return (info.distance < INF);
+	double tNear = -INF, tFar = INF;
+	int nearSide = 0, farSide = 0;
+	for (int dim = 0; dim < 3; dim++) {
+		if (fabs(ray.dir[dim]) < 1e-12) {
+			if (fabs(ray.start[dim] - O[dim]) > halfSide) return 0;
+			continue;
+		}
+		double t0 = (O[dim] - halfSide - ray.start[dim]) / ray.dir[dim];
+		double t1 = (O[dim] + halfSide - ray.start[dim]) / ray.dir[dim];
+		int side0 = 2 * dim, side1 = 2 * dim + 1;
+		if (t0 > t1) {
+			std::swap(t0, t1);
+			std::swap(side0, side1);
+		}
+		if (t0 > tNear) { tNear = t0; nearSide = side0; }
+		if (t1 < tFar) { tFar = t1; farSide = side1; }
+	}
+	if (tNear > tFar || tFar <= 0) return 0;
+	int n = 0;
+	if (tNear > 0) {
+		hits[n].distance = tNear;
+		hits[n++].primitive = nearSide;
+	}
+	if (n < maxHits) {
+		hits[n].distance = tFar;
+		hits[n++].primitive = farSide;
+	}
+	return n;
 }
 
-void CsgOp::findAllIntersections(Ray ray, Geometry* geom, std::vector<IntersectionInfo>& ips)
+bool Cube::getBBox(BBox& bbox) const
 {
-	IntersectionInfo info;
-	int counter = 30;
-	while (geom->intersect(ray, info) && counter-- > 0) {
-		ips.push_back(info);
-		ray.start = info.ip + ray.dir * 1e-6;
+	bbox.vmin = O - Vector(halfSide, halfSide, halfSide);
+	bbox.vmax = O + Vector(halfSide, halfSide, halfSide);
+	return true;
+}
+
+void CsgOp::beginRender()
+{
+	childBBoxesReady = false;
+}
+
+void CsgOp::fetchChildBBoxes()
+{
+	childBBoxesLock.enter();
+	if (!childBBoxesReady) {
+		leftBounded = left->getBBox(leftBBox);
+		rightBounded = right->getBBox(rightBBox);
+		childBBoxesReady.store(true, std::memory_order_release);
 	}
-	for (int i = 1; i < (int) ips.size(); i++)
-		ips[i].distance = ips[i - 1].distance + ips[i].distance + 1e-6;
+	childBBoxesLock.leave();
 }
 
-bool CsgOp::intersect(const Ray& ray, IntersectionInfo& info)
+/**
+ * finds the crossings of the CSG's surface along the ray, closer than maxDist.
+ * If stopAt >= 0, the search stops at the crossing with that index, and the child, whose surface it is,
+ * and the child's hit record, are returned in `child' and `childHit'. If hits isn't NULL, the crossings
+ * go there (at most MAX_CSG_HITS of them).
+ * @returns the number of the crossings found
+ */
+int CsgOp::findCrossings(const Ray& ray, double maxDist, HitRecord hits[], int stopAt,
+                         Geometry** child, HitRecord* childHit)
 {
-	vector<IntersectionInfo> leftIPs, rightIPs;
-	findAllIntersections(ray, left, leftIPs);
-	findAllIntersections(ray, right, rightIPs);
-	
-	bool inA = leftIPs.size() % 2 ? true : false;
-	bool inB = rightIPs.size() % 2 ? true : false;
-	
-	vector<IntersectionInfo> allIPs;
-	allIPs = leftIPs;
-	for (auto& ip: rightIPs) allIPs.push_back(ip);
-	
-	sort(allIPs.begin(), allIPs.end(), [] (const IntersectionInfo& left, const IntersectionInfo& right) { return left.distance < right.distance; });
+	if (!childBBoxesReady.load(std::memory_order_acquire)) fetchChildBBoxes();
+	RRay rray(ray);
+	rray.prepareForTracing();
+	// a child, whose bbox the ray misses (or enters beyond maxDist), has no crossings that we care about,
+	// and the ray is outside of it all the way, so it's treated as having no hits at all:
+	auto mayHit = [&] (bool bounded, const BBox& bbox) {
+		double tmin, tmax;
+		return !bounded || (bbox.clipRay(rray, tmin, tmax) && tmin < maxDist);
+	};
+	HitRecord leftHits[MAX_CSG_HITS], rightHits[MAX_CSG_HITS];
+	int numLeft = 0, numRight = 0;
+	if (mayHit(leftBounded, leftBBox))
+		numLeft = left->findAllHits(ray, leftHits, MAX_CSG_HITS);
+	// if we're outside the left child all along the ray, the right one may not matter at all (e.g. CsgAnd):
+	if (numLeft == 0 && !boolOp(false, false) && !boolOp(false, true)) return 0;
+	if (mayHit(rightBounded, rightBBox))
+		numRight = right->findAllHits(ray, rightHits, MAX_CSG_HITS);
+	if (numRight == 0 && !boolOp(false, false) && !boolOp(true, false)) return 0;
 	
+	// the parity of the crossings tells whether the ray starts inside:
+	bool inA = numLeft % 2 == 1;
+	bool inB = numRight % 2 == 1;
 	bool predicateNow = boolOp(inA, inB);
-	
-	for (auto& ip: allIPs) {
-		if (ip.geom == left)
+	// merge the two sorted lists, looking for where the predicate changes:
+	int i = 0, j = 0, n = 0;
+	while (i < numLeft || j < numRight) {
+		bool fromLeft = j >= numRight || (i < numLeft && leftHits[i].distance < rightHits[j].distance);
+		const HitRecord& hit = fromLeft ? leftHits[i++] : rightHits[j++];
+		if (hit.distance >= maxDist) break;
+		if (fromLeft)
 			inA = !inA;
 		else
 			inB = !inB;
-			
 		bool predicateNext = boolOp(inA, inB);
-		
-		if (predicateNext != predicateNow) {
-			info = ip;
-			return true;
+		if (predicateNext == predicateNow) continue;
+		predicateNow = predicateNext;
+		if (n == stopAt) {
+			*child = fromLeft ? left : right;
+			*childHit = hit;
+			return n + 1;
 		}
+		if (hits) {
+			hits[n].distance = hit.distance;
+			hits[n].primitive = n;
+		}
+		if (++n == MAX_CSG_HITS) break;
 	}
-	
-	return false;
+	return n;
 }
 
-bool Node::intersect(const Ray& ray, IntersectionInfo& data)
+bool CsgOp::intersect(const Ray& ray, IntersectionInfo& info)
+{
+	HitRecord hit;
+	if (!findHit(ray, INF, hit)) return false;
+	computeSurface(ray, hit, info);
+	return true;
+}
+
+bool CsgOp::findHit(const Ray& ray, double maxDist, HitRecord& hit)
+{
+	Geometry* child;
+	if (!findCrossings(ray, maxDist, NULL, 0, &child, &hit)) return false;
+	hit.primitive = 0;
+	return true;
+}
+
+/// the hit record's primitive is the index of the crossing (see findCrossings())
+void CsgOp::computeSurface(const Ray& ray, const HitRecord& hit, IntersectionInfo& info)
+{
+	Geometry* child;
+	HitRecord childHit;
+	findCrossings(ray, INF, NULL, hit.primitive, &child, &childHit);
+	child->computeSurface(ray, childHit, info);
+}
+
+int CsgOp::findAllHits(const Ray& ray, HitRecord hits[], int maxHits)
+{
+	if (maxHits >= MAX_CSG_HITS) return findCrossings(ray, INF, hits, -1, NULL, NULL);
+	HitRecord allHits[MAX_CSG_HITS];
+	int n = min(maxHits, findCrossings(ray, INF, allHits, -1, NULL, NULL));
+	for (int i = 0; i < n; i++) hits[i] = allHits[i];
+	return n;
+}
+
+bool CsgOp::intersectAny(const Ray& ray, double maxDist)
+{
+	// the surface of the result is a subset of the children's surfaces, so if neither of them is hit,
+	// we can skip the (expensive) full test:
+	if (!left->intersectAny(ray, maxDist) && !right->intersectAny(ray, maxDist)) return false;
+	HitRecord hit;
+	return findHit(ray, maxDist, hit);
+}
+
+bool CsgOp::getBBox(BBox& bbox) const
+{
+	BBox rightBBox;
+	if (!left->getBBox(bbox) || !right->getBBox(rightBBox)) return false;
+	bbox.add(rightBBox.vmin);
+	bbox.add(rightBBox.vmax);
+	return true;
+}
+
+bool CsgAnd::getBBox(BBox& bbox) const
+{
+	BBox leftBBox, rightBBox;
+	bool leftBounded = left->getBBox(leftBBox);
+	bool rightBounded = right->getBBox(rightBBox);
+	if (!leftBounded && !rightBounded) return false;
+	if (!leftBounded) { bbox = rightBBox; return true; }
+	if (!rightBounded) { bbox = leftBBox; return true; }
+	for (int dim = 0; dim < 3; dim++) {
+		bbox.vmin[dim] = max(leftBBox.vmin[dim], rightBBox.vmin[dim]);
+		bbox.vmax[dim] = max(bbox.vmin[dim], min(leftBBox.vmax[dim], rightBBox.vmax[dim]));
+	}
+	return true;
+}
+
+Ray Node::toObjectSpace(const Ray& ray, double& rayDirLength) const
 {
 	// world space -> object's canonic space
 	Ray rayCanonic = ray;
 	rayCanonic.start = transform.undoPoint(ray.start);
 	rayCanonic.dir = transform.undoDirection(ray.dir);
 	
-	double rayDirLength = rayCanonic.dir.length();
+	rayDirLength = rayCanonic.dir.length();
 	rayCanonic.dir.normalize();
-	if (!geom->intersect(rayCanonic, data)) 
-		return false;
-	
+	return rayCanonic;
+}
+
+void Node::toWorldSpace(IntersectionInfo& data, double rayDirLength) const
+{
 	// The intersection found is in object space, convert to world space:
 	data.normal = transform.normal(data.normal);
 	data.dNdx = transform.direction(data.dNdx);
@@ -205,6 +480,98 @@ bool Node::intersect(const Ray& ray, IntersectionInfo& data)
 	data.dNdy.normalize();
 	data.ip = transform.point(data.ip);
 	data.distance /= rayDirLength;  // (5)
+}
+
+bool Node::intersect(const Ray& ray, IntersectionInfo& data)
+{
+	if (geomInWorldSpace) return geom->intersect(ray, data);
+	double rayDirLength;
+	Ray rayCanonic = toObjectSpace(ray, rayDirLength);
+	if (!geom->intersect(rayCanonic, data)) 
+		return false;
+	
+	toWorldSpace(data, rayDirLength);
 	return true;
+}
+
+bool Node::intersectAny(const Ray& ray, double maxDist)
+{
+	if (geomInWorldSpace) return geom->intersectAny(ray, maxDist);
+	// distances in object space are longer by a factor of rayDirLength (see (5) in toWorldSpace()):
+	double rayDirLength;
+	Ray rayCanonic = toObjectSpace(ray, rayDirLength);
+	return geom->intersectAny(rayCanonic, maxDist * rayDirLength);
+}
 
+bool Node::findHit(const Ray& ray, double maxDist, HitRecord& hit)
+{
+	if (geomInWorldSpace) {
+		if (!geom->findHit(ray, maxDist, hit)) return false;
+		hit.objectDistance = hit.distance;
+		return true;
+	}
+	double rayDirLength;
+	Ray rayCanonic = toObjectSpace(ray, rayDirLength);
+	// search a bit further in object space, so that the final check below decides on the world space
+	// distances exactly as intersect() would:
+	if (!geom->findHit(rayCanonic, maxDist * rayDirLength * (1 + 1e-9), hit))
+		return false;
+	hit.objectDistance = hit.distance;
+	hit.distance /= rayDirLength; // see (5) in toWorldSpace()
+	return hit.distance < maxDist;
+}
+
+void Node::computeSurface(const Ray& ray, const HitRecord& hit, IntersectionInfo& info)
+{
+	if (geomInWorldSpace) {
+		geom->computeSurface(ray, hit, info);
+		return;
+	}
+	double rayDirLength;
+	Ray rayCanonic = toObjectSpace(ray, rayDirLength);
+	HitRecord geomHit = hit;
+	geomHit.distance = hit.objectDistance;
+	geom->computeSurface(rayCanonic, geomHit, info);
+	toWorldSpace(info, rayDirLength);
+}
+
+int Node::findHitPacket(const RayPacket& packet, int mask, const double maxDist[], HitRecord hits[])
+{
+	if (geomInWorldSpace) {
+		int found = geom->findHitPacket(packet, mask, maxDist, hits);
+		for (int i = 0; i < RayPacket::SIZE; i++) hits[i].objectDistance = hits[i].distance;
+		return found;
+	}
+	RayPacket packetCanonic;
+	double rayDirLength[RayPacket::SIZE], geomMaxDist[RayPacket::SIZE];
+	for (int i = 0; i < RayPacket::SIZE; i++) {
+		packetCanonic.rays[i] = RRay(toObjectSpace(packet.rays[i], rayDirLength[i]));
+		geomMaxDist[i] = maxDist[i] * rayDirLength[i] * (1 + 1e-9); // as in findHit()
+	}
+	packetCanonic.prepareForTracing();
+	
+	int found = geom->findHitPacket(packetCanonic, mask, geomMaxDist, hits);
+	for (int i = 0; i < RayPacket::SIZE; i++)
+		if (found & (1 << i)) {
+			hits[i].objectDistance = hits[i].distance;
+			hits[i].distance /= rayDirLength[i];
+			if (!(hits[i].distance < maxDist[i])) found &= ~(1 << i);
+		}
+	return found;
+}
+
+bool Node::getBBox(BBox& bbox) const
+{
+	BBox objectBBox;
+	if (!geom->getBBox(objectBBox)) return false;
+	// transform all the eight corners of the box to world space, and get the box around them:
+	bbox.makeEmpty();
+	for (int mask = 0; mask < 8; mask++) {
+		Vector corner(
+			(mask & 1) ? objectBBox.vmax.x : objectBBox.vmin.x,
+			(mask & 2) ? objectBBox.vmax.y : objectBBox.vmin.y,
+			(mask & 4) ? objectBBox.vmax.z : objectBBox.vmin.z);
+		bbox.add(transform.point(corner));
+	}
+	return true;
 }
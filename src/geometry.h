@@ -25,9 +25,13 @@
 #define __GEOMETRY_H__
 
 #include <vector>
+#include <atomic>
 #include "vector.h"
 #include "transform.h"
 #include "scene.h"
+#include "bbox.h"
+#include "packet.h"
+#include "cxxptl_sdl.h"
 
 
 class Geometry;
@@ -41,6 +45,21 @@ struct IntersectionInfo {
 	Vector dNdx, dNdy;
 };
 
+/**
+ * @brief a minimal record of a ray hit, kept while searching for the closest one (see Intersectable::findHit())
+ *
+ * The meaning of primitive, b1 and b2 is up to the primitive, which filled the record (e.g. for a mesh, these
+ * are the triangle index and the barycentric coordinates of the hit).
+ */
+struct HitRecord {
+	double distance;
+	double objectDistance; //!< the distance in the object space of the geometry (see Node::findHit())
+	int primitive;
+	double b1, b2;
+	int instance;            //!< the instance, which was hit (see Instances)
+	double instanceDistance; //!< the distance in the space of that instance's geometry
+};
+
 /**
  * @class Intersectable
  * @brief implements the interface to an intersectable primitive (geometry or node)
@@ -48,14 +67,75 @@ struct IntersectionInfo {
 class Intersectable {
 public:
 	virtual bool intersect(const Ray& ray, IntersectionInfo& info) = 0;
+	
+	/**
+	 * @brief checks whether the ray hits the primitive at a distance, smaller than maxDist (an occlusion query)
+	 *
+	 * Unlike intersect(), this may stop at any hit (not necessarily the closest one), and doesn't compute
+	 * any of the surface attributes (normals, UVs, etc.). The default implementation just calls intersect().
+	 */
+	virtual bool intersectAny(const Ray& ray, double maxDist)
+	{
+		IntersectionInfo info;
+		return intersect(ray, info) && info.distance < maxDist;
+	}
+	
+	/**
+	 * @brief finds the closest hit of the ray, if it's closer than maxDist, without computing the surface attributes
+	 *
+	 * Only a HitRecord is filled; the full IntersectionInfo for the closest hit overall is computed later with
+	 * computeSurface(). The default implementation just calls intersect().
+	 */
+	virtual bool findHit(const Ray& ray, double maxDist, HitRecord& hit)
+	{
+		IntersectionInfo info;
+		if (!intersect(ray, info) || info.distance >= maxDist) return false;
+		hit.distance = info.distance;
+		return true;
+	}
+	
+	/// computes the surface attributes of a hit, found by findHit() (with the same ray).
+	/// The default implementation just calls intersect() again.
+	virtual void computeSurface(const Ray& ray, const HitRecord& hit, IntersectionInfo& info)
+	{
+		intersect(ray, info);
+	}
+	
+	/**
+	 * @brief findHit() for the rays of a packet, which are given in the mask (see RayPacket).
+	 *
+	 * The i-th ray is limited to maxDist[i], and its hit goes to hits[i]. The default implementation
+	 * traces the rays one by one.
+	 * @returns a bitmask of the rays, which hit something.
+	 */
+	virtual int findHitPacket(const RayPacket& packet, int mask, const double maxDist[], HitRecord hits[])
+	{
+		int found = 0;
+		for (int i = 0; i < RayPacket::SIZE; i++)
+			if ((mask & (1 << i)) && findHit(packet.rays[i], maxDist[i], hits[i])) found |= 1 << i;
+		return found;
+	}
 };
 
 class Geometry: public Intersectable, public SceneElement {
 public:
 	virtual ~Geometry() {}
 	ElementType getElementType() const { return ELEM_GEOMETRY; }
+	/// gets a bounding box of the geometry (in object space). Valid after beginRender().
+	/// @returns false if the geometry is unbounded (e.g. an infinite plane)
+	virtual bool getBBox(BBox& bbox) const { return false; }
+	/**
+	 * @brief finds all the points, where the ray crosses the surface of the geometry, ordered by distance
+	 *
+	 * Used by the CSG operations. At most maxHits hits are returned. The default implementation calls findHit()
+	 * repeatedly, each time from just past the previous hit.
+	 * @returns the number of hits
+	 */
+	virtual int findAllHits(const Ray& ray, HitRecord hits[], int maxHits);
 };
 
+#define MAX_CSG_HITS 32 //!< the most surface crossings along a ray, considered in a CSG child
+
 class Plane: public Geometry {
 public:
 	double y;
@@ -67,6 +147,11 @@ public:
 		pb.getDoubleProp("limit", &limit);
 	}
 	bool intersect(const Ray& ray, IntersectionInfo& info);
+	bool intersectAny(const Ray& ray, double maxDist);
+	bool findHit(const Ray& ray, double maxDist, HitRecord& hit);
+	void computeSurface(const Ray& ray, const HitRecord& hit, IntersectionInfo& info);
+	bool getBBox(BBox& bbox) const;
+	int findAllHits(const Ray& ray, HitRecord hits[], int maxHits);
 };
 
 class Sphere: public Geometry {
@@ -81,10 +166,15 @@ public:
 	}
 	
 	bool intersect(const Ray& ray, IntersectionInfo& info);
+	bool intersectAny(const Ray& ray, double maxDist);
+	bool findHit(const Ray& ray, double maxDist, HitRecord& hit);
+	void computeSurface(const Ray& ray, const HitRecord& hit, IntersectionInfo& info);
+	bool getBBox(BBox& bbox) const;
+	int findAllHits(const Ray& ray, HitRecord hits[], int maxHits);
 };
 
 class Cube: public Geometry {
-	bool intersectSide(double level, double start, double dir, const Ray& ray, const Vector& normal, IntersectionInfo& info);
+	bool hitSide(double level, double start, double dir, const Ray& ray, double& distance, Vector& ip) const;
 public:
 	Vector O;
 	double halfSide;
@@ -97,13 +187,37 @@ public:
 	}
 
 	bool intersect(const Ray& ray, IntersectionInfo& info);
+	bool intersectAny(const Ray& ray, double maxDist);
+	bool findHit(const Ray& ray, double maxDist, HitRecord& hit);
+	void computeSurface(const Ray& ray, const HitRecord& hit, IntersectionInfo& info);
+	bool getBBox(BBox& bbox) const;
+	int findAllHits(const Ray& ray, HitRecord hits[], int maxHits);
 };
 
+/**
+ * @brief a boolean operation on two geometries
+ *
+ * The children report all their surface crossings along the ray (see Geometry::findAllHits()), into
+ * fixed-size arrays on the stack; the two sorted lists are merged, and the result's surface is where
+ * boolOp() changes. The hit record of a CSG hit only holds the index of that crossing: the child's
+ * surface is computed by repeating the search in computeSurface(), for the closest hit only.
+ */
 class CsgOp: public Geometry {
-	void findAllIntersections(Ray ray, Geometry* geom, std::vector<IntersectionInfo>& ips);
+	/*
+	 * The children's bboxes are fetched on first use, and not in beginRender(): a child may be an
+	 * Instances, which only knows its bbox after its own beginRender(), and that runs last.
+	 */
+	BBox leftBBox, rightBBox;
+	bool leftBounded, rightBounded;
+	std::atomic<bool> childBBoxesReady;
+	Mutex childBBoxesLock;
+	void fetchChildBBoxes();
+	int findCrossings(const Ray& ray, double maxDist, HitRecord hits[], int stopAt,
+	                  Geometry** child, HitRecord* childHit);
 public:
 	Geometry *left, *right;
 	
+	CsgOp(): childBBoxesReady(false) {}
 	virtual bool boolOp(bool inA, bool inB) = 0;
 
 	void fillProperties(ParsedBlock& pb)
@@ -114,12 +228,19 @@ public:
 		pb.getGeometryProp("right", &right);
 	}
 	
+	void beginRender();
 	bool intersect(const Ray& ray, IntersectionInfo& info);
+	bool intersectAny(const Ray& ray, double maxDist);
+	bool findHit(const Ray& ray, double maxDist, HitRecord& hit);
+	void computeSurface(const Ray& ray, const HitRecord& hit, IntersectionInfo& info);
+	int findAllHits(const Ray& ray, HitRecord hits[], int maxHits);
+	bool getBBox(BBox& bbox) const; // the union of the children's bboxes
 };
 
 class CsgAnd: public CsgOp {
 public:
 	bool boolOp(bool inA, bool inB) { return inA && inB; }
+	bool getBBox(BBox& bbox) const; // the intersection of the children's bboxes
 };
 
 class CsgPlus: public CsgOp {
@@ -130,6 +251,7 @@ public:
 class CsgMinus: public CsgOp {
 public:
 	bool boolOp(bool inA, bool inB) { return inA && !inB; }
+	bool getBBox(BBox& bbox) const { return left->getBBox(bbox); }
 };
 
 class Shader;
@@ -139,12 +261,25 @@ struct Node: public Intersectable, public SceneElement {
 	Shader* shader;
 	Transform transform;
 	Texture* bump;
+	bool geomInWorldSpace; //!< the geometry is already transformed to world space (see Scene::bakeTransforms())
 	
-	Node() { bump = NULL; }
-	Node(Geometry* g, Shader* s) { geom = g; shader = s; bump = NULL; }
+	/// transforms a ray to the object's canonic space; rayDirLength gets the length of the transformed direction
+	Ray toObjectSpace(const Ray& ray, double& rayDirLength) const;
+	/// transforms an intersection, found with a ray from toObjectSpace(), back to world space
+	void toWorldSpace(IntersectionInfo& data, double rayDirLength) const;
+	
+	Node() { bump = NULL; geomInWorldSpace = false; }
+	Node(Geometry* g, Shader* s) { geom = g; shader = s; bump = NULL; geomInWorldSpace = false; }
 	
 	// from Intersectable:
 	bool intersect(const Ray& ray, IntersectionInfo& data);
+	bool intersectAny(const Ray& ray, double maxDist);
+	bool findHit(const Ray& ray, double maxDist, HitRecord& hit);
+	void computeSurface(const Ray& ray, const HitRecord& hit, IntersectionInfo& info);
+	int findHitPacket(const RayPacket& packet, int mask, const double maxDist[], HitRecord hits[]);
+	
+	/// gets the bounding box of the node in world space. Returns false if the geometry is unbounded.
+	bool getBBox(BBox& bbox) const;
 
 	// from SceneElement:
 	ElementType getElementType() const { return ELEM_NODE; }
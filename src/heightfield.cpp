@@ -23,21 +23,304 @@
  */
 #include "heightfield.h"
 #include "bitmap.h"
+#include "scene.h"
+#include "cxxptl_sdl.h"
 #include <SDL/SDL.h>
+#include <string.h>
+#include <algorithm>
+using std::vector;
+
+extern ThreadPool pool; // from main.cpp
+
+/// Computes a level of the max-height pyramid from the level below, with the rows split among the threads
+class ParallelMipBuilder: public Parallel {
+	Heightfield& hf;
+	int level;
+	InterlockedInt counter;
+public:
+	ParallelMipBuilder(Heightfield& hf, int level): hf(hf), level(level), counter(0) {}
+	void entry(int threadIdx, int threadCount)
+	{
+		float* dest = hf.getLevel(level);
+		int srcW = hf.levelW[level - 1], srcH = hf.levelH[level - 1];
+		int w = hf.levelW[level], h = hf.levelH[level];
+		int y;
+		while ((y = counter++) < h) {
+			int y0 = 2 * y, y1 = min(2 * y + 1, srcH - 1);
+			for (int x = 0; x < w; x++) {
+				int x0 = 2 * x, x1 = min(2 * x + 1, srcW - 1);
+				// (level 0 isn't stored, so getCellMax() is used for it)
+				if (level == 1) {
+					dest[y * w + x] = max(max(hf.getCellMax(0, x0, y0), hf.getCellMax(0, x1, y0)),
+					                      max(hf.getCellMax(0, x0, y1), hf.getCellMax(0, x1, y1)));
+				} else {
+					const float* src = hf.getLevel(level - 1);
+					dest[y * w + x] = max(max(src[y0 * srcW + x0], src[y0 * srcW + x1]),
+					                      max(src[y1 * srcW + x0], src[y1 * srcW + x1]));
+				}
+			}
+		}
+	}
+};
+
+/// calculates the gaussian coefficients for the given sigma, see http://en.wikipedia.org/wiki/Gaussian_blur
+/// kernel[i] is the weight at distance i; returns the radius R (the size of kernel[]), or 0 if there's no blur
+static int gaussianKernel(double sigma, vector<float>& kernel)
+{
+	// The radius is capped like before, so the output stays the same.
+	int R = min(128, nearestInt(float(3 * sigma)));
+	if (R < 1) return 0;
+	kernel.resize(R);
+	for (int i = 0; i < R; i++)
+		kernel[i] = float(exp(-sqr(i) / (2 * sqr(sigma))) / sqrt(2 * PI * sqr(sigma)));
+	return R;
+}
+
+/// the horizontal blur of a single row (in[] and out[] are W floats); pixels outside the image count as zero
+static void blurRowHorizontal(const float* in, float* out, int W, const float* kernel, int R)
+{
+	for (int x = 0; x < W; x++) out[x] = 0;
+	for (int d = -R + 1; d < R; d++) {
+		const float w = kernel[abs(d)];
+		// (indexed as in[x + d], and not through a pointer at in + d, which may be before the start of the row)
+		int xStart = max(0, -d), xEnd = min(W, W - d);
+		for (int x = xStart; x < xEnd; x++)
+			out[x] += w * in[x + d];
+	}
+}
+
+/// the vertical blur of a single row: rows[R - 1 + d] is the row at distance d (-R < d < R), or NULL,
+/// if it's outside the image (and counts as zero)
+static void blurRowVertical(const float* const* rows, float* out, int W, const float* kernel, int R)
+{
+	for (int x = 0; x < W; x++) out[x] = 0;
+	for (int d = -R + 1; d < R; d++) {
+		const float w = kernel[abs(d)];
+		const float* in = rows[R - 1 + d];
+		if (!in) continue;
+		for (int x = 0; x < W; x++)
+			out[x] += w * in[x];
+	}
+}
+
+/// One pass of a separable blur: convolves each row (or each column) of `src' with a symmetric kernel.
+/// Pixels outside the image count as zero. Both passes are done row by row, so the inner loops run over
+/// contiguous memory and vectorize; the rows are split among the threads.
+class ParallelBlurPass: public Parallel {
+	const float* src;
+	float* dest;
+	int W, H;
+	const float* kernel; //!< kernel[0..R-1], kernel[i] is the weight at distance i
+	int R;
+	bool vertical;
+	InterlockedInt counter;
+public:
+	ParallelBlurPass(const float* src, float* dest, int W, int H, const float* kernel, int R, bool vertical):
+		src(src), dest(dest), W(W), H(H), kernel(kernel), R(R), vertical(vertical), counter(0) {}
+	void entry(int threadIdx, int threadCount)
+	{
+		vector<const float*> rows(2 * R - 1);
+		int y;
+		while ((y = counter++) < H) {
+			if (vertical) {
+				for (int d = -R + 1; d < R; d++)
+					rows[R - 1 + d] = (y + d < 0 || y + d >= H) ? NULL : &src[(y + d) * W];
+				blurRowVertical(&rows[0], &dest[y * W], W, kernel, R);
+			} else {
+				blurRowHorizontal(&src[y * W], &dest[y * W], W, kernel, R);
+			}
+		}
+	}
+};
+
+/// Applies a gaussian blur with the given sigma to a W x H float image, in place
+static void gaussianBlur(float* image, int W, int H, double sigma)
+{
+	// The 2D gaussian is a product of two 1D gaussians, so the blur is done as two 1D passes:
+	// O(R) per pixel instead of O(R^2).
+	vector<float> kernel;
+	int R = gaussianKernel(sigma, kernel);
+	if (!R) return;
+	int numThreads = scene.settings.numThreads ? scene.settings.numThreads : get_processor_count();
+	numThreads = max(1, min(numThreads, H / 16));
+	float* temp = new float[W * H];
+	ParallelBlurPass horizontal(image, temp, W, H, &kernel[0], R, false);
+	pool.run(&horizontal, numThreads);
+	ParallelBlurPass vertical(temp, image, W, H, &kernel[0], R, true);
+	pool.run(&vertical, numThreads);
+	delete[] temp;
+}
+
+/// packs a unit vector in the octahedral encoding: the vector is projected on the octahedron |x|+|y|+|z| = 1,
+/// whose lower half is folded over the upper one, and then (x, y) are quantized
+static PackedNormal packNormal(const Vector& n)
+{
+	double s = fabs(n.x) + fabs(n.y) + fabs(n.z);
+	double x = n.x / s, y = n.y / s;
+	if (n.z < 0) {
+		double fx = (1 - fabs(y)) * (x >= 0 ? 1 : -1);
+		double fy = (1 - fabs(x)) * (y >= 0 ? 1 : -1);
+		x = fx;
+		y = fy;
+	}
+	PackedNormal result;
+	result.u = (unsigned short) nearestInt(float((x * 0.5 + 0.5) * 65535));
+	result.v = (unsigned short) nearestInt(float((y * 0.5 + 0.5) * 65535));
+	return result;
+}
+
+/// the reverse of packNormal()
+static inline Vector unpackNormal(PackedNormal p)
+{
+	double x = p.u * (2.0 / 65535) - 1, y = p.v * (2.0 / 65535) - 1;
+	double z = 1 - fabs(x) - fabs(y);
+	if (z < 0) {
+		double fx = (1 - fabs(y)) * (x >= 0 ? 1 : -1);
+		double fy = (1 - fabs(x)) * (y >= 0 ? 1 : -1);
+		x = fx;
+		y = fy;
+	}
+	Vector n(x, y, z);
+	n.normalize();
+	return n;
+}
+
+static const char TILED_HEIGHTFIELD_MAGIC[8] = { 'Q', 'D', 'H', 'F', 'I', 'E', 'L', 'D' };
+static const int TILED_HEIGHTFIELD_VERSION = 1;
+
+/// the number of 16-bit values in a tile record: the samples, and then the levels 1..TILE_BITS-1 of its pyramid
+static int tileValues()
+{
+	int n = HEIGHTFIELD_TILE_SIZE * HEIGHTFIELD_TILE_SIZE;
+	for (int k = 1; k < HEIGHTFIELD_TILE_BITS; k++) n += (HEIGHTFIELD_TILE_SIZE >> k) * (HEIGHTFIELD_TILE_SIZE >> k);
+	return n;
+}
+
+/// the offset of the k-th level (k > 0) of a tile's pyramid in the tile record
+static int tileLevelOffset(int k)
+{
+	int offset = HEIGHTFIELD_TILE_SIZE * HEIGHTFIELD_TILE_SIZE;
+	for (int i = 1; i < k; i++) offset += (HEIGHTFIELD_TILE_SIZE >> i) * (HEIGHTFIELD_TILE_SIZE >> i);
+	return offset;
+}
+
+HeightfieldTiles::HeightfieldTiles()
+{
+	header = NULL;
+	tileMax = NULL;
+	maxResident = 0;
+	useClock = 1;
+	pageIns = 0;
+}
+
+bool HeightfieldTiles::open(const char* filename, int maxResident)
+{
+	if (!file.open(filename) || file.size() < sizeof(TiledHeightfieldHeader)) return false;
+	header = (const TiledHeightfieldHeader*) file.data();
+	int numTiles = header->tilesX * header->tilesY;
+	if (memcmp(header->magic, TILED_HEIGHTFIELD_MAGIC, 8) || header->version != TILED_HEIGHTFIELD_VERSION ||
+	    header->W < 2 || header->H < 2 ||
+	    header->tilesX != (header->W + HEIGHTFIELD_TILE_SIZE - 1) / HEIGHTFIELD_TILE_SIZE ||
+	    header->tilesY != (header->H + HEIGHTFIELD_TILE_SIZE - 1) / HEIGHTFIELD_TILE_SIZE ||
+	    header->tileStride < tileValues() * 2 ||
+	    header->tilesOffset < (long long) (sizeof(TiledHeightfieldHeader) + numTiles * 2) ||
+	    (long long) file.size() != header->tilesOffset + (long long) numTiles * header->tileStride) {
+		file.close();
+		return false;
+	}
+	tileMax = (const unsigned short*) (header + 1);
+	this->maxResident = maxResident;
+	lastUse = std::vector<std::atomic<unsigned> >(numTiles); // (all zeros)
+	residentTiles.clear();
+	
+	// the levels above the tiles (a tile is a cell at level HEIGHTFIELD_TILE_BITS):
+	int w = header->tilesX, h = header->tilesY, k = HEIGHTFIELD_TILE_BITS;
+	topLevels.resize(numTiles);
+	for (int i = 0; i < numTiles; i++) topLevels[i] = decode(tileMax[i]);
+	topLevelOffset[k] = 0;
+	topLevelW[k] = w;
+	while ((w > 1 || h > 1) && k + 1 < MAX_HEIGHTFIELD_LEVELS) {
+		int nw = (w + 1) / 2, nh = (h + 1) / 2;
+		int src = topLevelOffset[k];
+		topLevelOffset[++k] = int(topLevels.size());
+		topLevelW[k] = nw;
+		topLevels.resize(topLevels.size() + nw * nh);
+		for (int y = 0; y < nh; y++)
+			for (int x = 0; x < nw; x++) {
+				int x0 = 2 * x, x1 = min(2 * x + 1, w - 1), y0 = 2 * y, y1 = min(2 * y + 1, h - 1);
+				topLevels[topLevelOffset[k] + y * nw + x] =
+					max(max(topLevels[src + y0 * w + x0], topLevels[src + y0 * w + x1]),
+					    max(topLevels[src + y1 * w + x0], topLevels[src + y1 * w + x1]));
+			}
+		w = nw;
+		h = nh;
+	}
+	return true;
+}
+
+/// pages in a tile, which isn't resident, and marks it as the most recently used one; the least recently
+/// used tile may be dropped
+void HeightfieldTiles::pageIn(int tile) const
+{
+	lock.enter();
+	// (another thread may have paged it in, while we were waiting for the lock)
+	if (lastUse[tile].load(std::memory_order_relaxed) == 0) {
+		residentTiles.push_back(tile);
+		pageIns++;
+		unsigned clock = useClock.load(std::memory_order_relaxed) + 1;
+		useClock.store(clock, std::memory_order_relaxed);
+		lastUse[tile].store(clock, std::memory_order_relaxed);
+		if (int(residentTiles.size()) > maxResident) {
+			int oldest = 0;
+			unsigned oldestUse = lastUse[residentTiles[0]].load(std::memory_order_relaxed);
+			for (int i = 1; i < int(residentTiles.size()); i++) {
+				unsigned use = lastUse[residentTiles[i]].load(std::memory_order_relaxed);
+				if (use < oldestUse) {
+					oldest = i;
+					oldestUse = use;
+				}
+			}
+			int victim = residentTiles[oldest];
+			residentTiles[oldest] = residentTiles.back();
+			residentTiles.pop_back();
+			lastUse[victim].store(0, std::memory_order_relaxed);
+			// (a thread, which still reads the victim tile, just makes the OS read its pages again)
+			file.discard(size_t(header->tilesOffset) + size_t(victim) * header->tileStride, header->tileStride);
+		}
+	}
+	lock.leave();
+}
+
+float HeightfieldTiles::getCellMax(int level, int cx, int cy) const
+{
+	if (level >= HEIGHTFIELD_TILE_BITS)
+		return topLevels[topLevelOffset[level] + cy * topLevelW[level] + cx];
+	// a cell at a lower level is entirely inside a tile:
+	int shift = HEIGHTFIELD_TILE_BITS - level;
+	const unsigned short* tile = getTile((cy >> shift) * header->tilesX + (cx >> shift));
+	int size = HEIGHTFIELD_TILE_SIZE >> level;
+	return decode(tile[tileLevelOffset(level) + (cy & (size - 1)) * size + (cx & (size - 1))]);
+}
 
 Heightfield::Heightfield()
 {
 	heights = NULL;
 	normals = NULL;
-	maxH = NULL;
-	highMap = NULL;
+	packedNormals = NULL;
+	normalStorage = NORMALS_FULL;
+	maxMip = NULL;
+	tiles = NULL;
+	maxResidentTiles = 256;
+	numLevels = 1;
+	useOptimization = true;
 }
 Heightfield::~Heightfield()
 {
 	if (heights) delete[] heights;
 	if (normals) delete[] normals;
-	if (maxH) delete[] maxH;
-	if (highMap) delete[] highMap;
+	if (packedNormals) delete[] packedNormals;
+	if (maxMip) delete[] maxMip;
+	if (tiles) delete tiles;
 }
 
 
@@ -47,58 +330,59 @@ float Heightfield::getHeight(int x, int y) const
 	y = min(H - 1, y);
 	x = max(0, x);
 	y = max(0, y);
+	if (tiles) return tiles->getHeight(x, y);
 	return heights[y * W + x];
 }
 
-float Heightfield::getHighest(int x, int y, int k) const
+Vector Heightfield::computeNormal(int x, int y) const
 {
-	x = min(W - 1, x);
-	y = min(H - 1, y);
-	x = max(0, x);
-	y = max(0, y);
-	return highMap[y * W + x].h[k];
+	// (the normals at the last row and column are the same as those before them)
+	x = min(x, W - 2);
+	y = min(y, H - 2);
+	float h0 = getHeight(x, y);
+	float hdx = getHeight(x + 1, y);
+	float hdy = getHeight(x, y + 1);
+	Vector vdx = Vector(1, hdx - h0, 0);
+	Vector vdy = Vector(0, hdy - h0, 1);
+	Vector norm = vdy ^ vdx;
+	norm.normalize();
+	return norm;
 }
 
+float Heightfield::getCellMax(int level, int cx, int cy) const
+{
+	if (level > 0) return tiles ? tiles->getCellMax(level, cx, cy) : getLevel(level)[cy * levelW[level] + cx];
+	if (tiles)
+		return max(max(getHeight(cx, cy), getHeight(cx + 1, cy)), max(getHeight(cx, cy + 1), getHeight(cx + 1, cy + 1)));
+	// the highest of the four corners of the voxel:
+	const float* row = &heights[cy * W];
+	const float* nextRow = cy < H - 1 ? row + W : row;
+	int cx1 = min(cx + 1, W - 1);
+	return max(max(row[cx], row[cx1]), max(nextRow[cx], nextRow[cx1]));
+}
 
-void Heightfield::buildHighMap()
+void Heightfield::buildMaxMip()
 {
-	maxK = ceil(log(max(W, H)) / log(2));
-	
-	highMap = new HighStruct[W * H];
-	
-	for (int y = 0; y < H; y++) {
-		for (int x = 0; x < W; x++) {
-			float& thisHeight = highMap[y * W + x].h[0];
-			thisHeight = getHeight(x, y);
-			for (int dy = -1; dy <= 1; dy++)
-				for (int dx = -1; dx <= 1; dx++)
-					thisHeight = max(thisHeight, getHeight(x + dx, y + dy));
-		}
+	int total = 0;
+	while (levelW[numLevels - 1] > 1 || levelH[numLevels - 1] > 1) {
+		int k = numLevels++;
+		levelW[k] = (levelW[k - 1] + 1) / 2;
+		levelH[k] = (levelH[k - 1] + 1) / 2;
+		levelOffset[k] = total;
+		total += levelW[k] * levelH[k];
 	}
-	
-	// r = 1 -> square 3x3
-	// r = 2 -> square 5x5
-	// r = 4 -> square 9x9
-	// r = 2^k -> square (2^(k+1) + 1)x(2^(k+1) + 1)
-	// r = 2^k -> offset-> 2^(k - 1) 
-	for (int k = 1; k < maxK; k++) {
-		for (int y = 0; y < H; y++) {
-			for (int x = 0; x < W; x++) {
-				int offset = (1 << (k - 1));
-				highMap[y * W + x].h[k] = 
-					max(
-						max(getHighest(x - offset, y - offset, k - 1),
-							getHighest(x + offset, y - offset, k - 1)),
-						max(getHighest(x - offset, y + offset, k - 1),
-							getHighest(x + offset, y + offset, k - 1)));
-			}
-		}
+	maxMip = new float[max(1, total)];
+	int numThreads = max(1, scene.settings.numThreads);
+	for (int k = 1; k < numLevels; k++) {
+		ParallelMipBuilder builder(*this, k);
+		// (the small levels aren't worth waking up the threads)
+		pool.run(&builder, levelH[k] >= 64 ? numThreads : 1);
 	}
 }
 
 Vector Heightfield::getNormal(float x, float y) const
 {
-	// we have precalculated the normals at each integer position.
+	// we have the normals at each integer position (precalculated or computed on the spot).
 	// Here, we do bilinear filtering on the four nearest integral positions:
 	int x0 = (int) floor(x);
 	int y0 = (int) floor(y);
@@ -110,175 +394,369 @@ Vector Heightfield::getNormal(float x, float y) const
 	y0 = min(H - 1, y0);
 	x0 = max(0, x0);
 	y0 = max(0, y0);
+	auto normalAt = [this] (int x, int y) {
+		switch (normalStorage) {
+			case NORMALS_FULL: return normals[y * W + x];
+			case NORMALS_OCTAHEDRAL: return unpackNormal(packedNormals[y * W + x]);
+			default: return computeNormal(x, y);
+		}
+	};
 	Vector v = 
-		normals[y0 * W + x0] * ((1 - p) * (1 - q)) +
-		normals[y0 * W + x1] * ((    p) * (1 - q)) +
-		normals[y1 * W + x0] * ((1 - p) * (    q)) +
-		normals[y1 * W + x1] * ((    p) * (    q));
+		normalAt(x0, y0) * ((1 - p) * (1 - q)) +
+		normalAt(x1, y0) * ((    p) * (1 - q)) +
+		normalAt(x0, y1) * ((1 - p) * (    q)) +
+		normalAt(x1, y1) * ((    p) * (    q));
 	v.normalize();
 	return v;
 }
 
-bool Heightfield::intersect(const Ray& _ray, IntersectionInfo& info)
+/**
+ * marches the ray through the heightfield, and finds the first hit, closer than maxDist.
+ *
+ * The voxels are visited in order along the ray, but using the max-height pyramid: if the ray is above
+ * the highest point of a cell (at some level), the whole cell is skipped. Otherwise, we descend to the
+ * finer level, until we get to a single voxel, whose two triangles are tested. After a cell is left, we
+ * go one level up.
+ */
+bool Heightfield::march(const RRay& ray, double maxDist, double& hitDist) const
 {
-	RRay ray(_ray);
-	ray.prepareForTracing();
-	Vector step = ray.dir;
-	double distHoriz = sqrt(sqr(step.x) + sqr(step.z));
-	step /= distHoriz;
-	double dist = bbox.closestIntersection(ray);
-	Vector p = ray.start + ray.dir * (dist + 1e-6); // step firmly inside the bbox
+	double t, tmax;
+	if (!bbox.clipRay(ray, t, tmax)) return false;
+	tmax = min(tmax, maxDist);
 	
-
-	double mx = 1.0 / ray.dir.x; // mx = how much to go along ray.dir until the unit distance along X is traversed
-	double mz = 1.0 / ray.dir.z; // same as mx, for Z
-
-	while (bbox.inside(p)) {
-		int x0 = (int) floor(p.x);
-		int z0 = (int) floor(p.z);
-		if (x0 < 0 || x0 >= W || z0 < 0 || z0 >= H) break; // if outside the [0..W)x[0..H) rect, get out
-
-		if (useOptimization) {
-			int k = 0;
-			while (k < maxK && min(p.y, p.y + ray.dir.y * (1 << k)) > getHighest(x0, z0, k))
-				k++;
-			k--;
-			if (k >= 0) {
-				p += ray.dir * (1 << k);
-				x0 = (int) floor(p.x);
-				z0 = (int) floor(p.z);
-				if (x0 < 0 || x0 >= W || z0 < 0 || z0 >= H) break; // if outside the [0..W)x[0..H) rect, get out
-			}
-		}
+	Vector p = ray.start + ray.dir * t;
+	int x = max(0, min(W - 1, (int) floor(p.x)));
+	int z = max(0, min(H - 1, (int) floor(p.z)));
+	int level = numLevels - 1;
+	
+	while (t <= tmax) {
+		int size = 1 << level;
+		int cx = x >> level, cz = z >> level;
+		// where does the ray leave the current cell (along X or along Z)?
+		double tx = INF, tz = INF;
+		if (ray.dir.x > 0) tx = ((cx + 1) * size - ray.start.x) * ray.rdir.x;
+		if (ray.dir.x < 0) tx = (cx * size - ray.start.x) * ray.rdir.x;
+		if (ray.dir.z > 0) tz = ((cz + 1) * size - ray.start.z) * ray.rdir.z;
+		if (ray.dir.z < 0) tz = (cz * size - ray.start.z) * ray.rdir.z;
+		double tExit = min(tx, tz);
+		double yLow = ray.start.y + ray.dir.y * (ray.dir.y > 0 ? t : min(tExit, tmax));
 		
-		// calculate how much we need to go along ray.dir until we hit the next X voxel boundary:
-		double lx = ray.dir.x > 0 ? (ceil(p.x) - p.x) * mx : (floor(p.x) - p.x) * mx;
-		// same as lx, for the Z direction:
-		double lz = ray.dir.z > 0 ? (ceil(p.z) - p.z) * mz : (floor(p.z) - p.z) * mz;
-		// advance p along ray.dir until we hit the next X or Z gridline
-		// also, go a little more than that, to assure we're firmly inside the next voxel:
-		Vector p_next = p + step * (min(lx, lz) + 1e-6);
-		// "p" is position before advancement; p_next is after we take a single step.
-		// if any of those are below the height of the nearest four voxels of the heightfield,
-		// we need to test the current voxel for intersection:
-		if (min(p.y, p_next.y) < maxH[z0 * W + x0]) {
+		if (yLow < getCellMax(level, cx, cz)) {
+			if (level > 0) {
+				level--;
+				continue;
+			}
 			double closestDist = INF;
 			// form ABCD - the four corners of the current voxel, whose heights are taken from the heightmap
 			// then form triangles ABD and BCD and try to intersect the ray with each of them:
-			Vector A = Vector(x0, getHeight(x0, z0), z0);
-			Vector B = Vector(x0 + 1, getHeight(x0 + 1, z0), z0);
-			Vector C = Vector(x0 + 1, getHeight(x0 + 1, z0 + 1), z0 + 1);
-			Vector D = Vector(x0, getHeight(x0, z0 + 1), z0 + 1);
+			Vector A = Vector(x, getHeight(x, z), z);
+			Vector B = Vector(x + 1, getHeight(x + 1, z), z);
+			Vector C = Vector(x + 1, getHeight(x + 1, z + 1), z + 1);
+			Vector D = Vector(x, getHeight(x, z + 1), z + 1);
 			if (intersectTriangleFast(ray, A, B, D, closestDist) ||
 			    intersectTriangleFast(ray, B, C, D, closestDist)) {
 				// intersection found: ray hits either triangle ABD or BCD. Which one exactly isn't
 				// important, because we calculate the normals by bilinear interpolation of the
 				// precalculated normals at the four corners:
-				info.distance = closestDist;
-				info.ip = ray.start + ray.dir * closestDist;
-				info.normal = getNormal((float) info.ip.x, (float) info.ip.z);
-				info.u = info.ip.x / W;
-				info.v = info.ip.z / H;
-				info.dNdx = Vector(1, 0, 0);
-				info.dNdy = Vector(0, 0, 1);
-				info.geom = this;
-				return true;
+				hitDist = closestDist;
+				return closestDist < maxDist;
 			}
 		}
-		p = p_next;
+		// step to the next cell (at the same level). The voxel coordinates are advanced explicitly, so that
+		// rounding can't get us stuck at a cell boundary:
+		if (tExit >= INF) break;
+		t = tExit;
+		if (tx <= tz) {
+			x = ray.dir.x > 0 ? (cx + 1) * size : cx * size - 1;
+			z = max(cz * size, min((cz + 1) * size - 1, (int) floor(ray.start.z + ray.dir.z * t)));
+		} else {
+			z = ray.dir.z > 0 ? (cz + 1) * size : cz * size - 1;
+			x = max(cx * size, min((cx + 1) * size - 1, (int) floor(ray.start.x + ray.dir.x * t)));
+		}
+		if (x < 0 || x >= W || z < 0 || z >= H) break; // if outside the [0..W)x[0..H) rect, get out
+		level = min(level + 1, numLevels - 1);
 	}
 	return false;
 }
 
+bool Heightfield::intersect(const Ray& ray, IntersectionInfo& info)
+{
+	HitRecord hit;
+	if (!findHit(ray, INF, hit)) return false;
+	computeSurface(ray, hit, info);
+	return true;
+}
+
+bool Heightfield::findHit(const Ray& _ray, double maxDist, HitRecord& hit)
+{
+	RRay ray(_ray);
+	ray.prepareForTracing();
+	return march(ray, maxDist, hit.distance);
+}
+
+void Heightfield::computeSurface(const Ray& ray, const HitRecord& hit, IntersectionInfo& info)
+{
+	info.distance = hit.distance;
+	info.ip = ray.start + ray.dir * hit.distance;
+	info.normal = getNormal((float) info.ip.x, (float) info.ip.z);
+	info.u = info.ip.x / W;
+	info.v = info.ip.z / H;
+	info.dNdx = Vector(1, 0, 0);
+	info.dNdy = Vector(0, 0, 1);
+	info.geom = this;
+}
+
+bool Heightfield::intersectAny(const Ray& _ray, double maxDist)
+{
+	RRay ray(_ray);
+	ray.prepareForTracing();
+	double hitDist;
+	return march(ray, maxDist, hitDist);
+}
+
 void Heightfield::fillProperties(ParsedBlock& pb)
 {
 	pb.getBoolProp("useOptimization", &useOptimization);
+	char storage[256];
+	if (pb.getStringProp("normals", storage)) {
+		if (!strcmp(storage, "full")) normalStorage = NORMALS_FULL;
+		else if (!strcmp(storage, "octahedral")) normalStorage = NORMALS_OCTAHEDRAL;
+		else if (!strcmp(storage, "computed")) normalStorage = NORMALS_COMPUTED;
+		else pb.signalError("Unknown normal storage (expected \"full\", \"octahedral\" or \"computed\")");
+	}
+	char fn[256];
+	if (!pb.getFilenameProp("file", fn)) pb.requiredProp("file");
+	if (extensionUpper(fn) == "QDHF") {
+		normalStorage = NORMALS_COMPUTED;
+		pb.getIntProp("maxResidentTiles", &maxResidentTiles, 1);
+		if (!loadTiled(fn)) pb.signalError("Could not load the tiled heightfield file!");
+		return;
+	}
 	Bitmap bmp;
-	if (!pb.getBitmapFileProp("file", bmp)) pb.requiredProp("file");
-	W = bmp.getWidth();
-	H = bmp.getHeight();
+	if (!bmp.loadImage(fn)) pb.signalError("Could not load the heightfield image!");
 	double blur = 0;
 	pb.getDoubleProp("blur", &blur, 0, 1000);
-	// do we have blur? if no, just fetch the source image and store it:
+	loadFromBitmap(bmp, blur);
+}
+
+void Heightfield::loadFromBitmap(const Bitmap& bmp, double blur)
+{
+	W = bmp.getWidth();
+	H = bmp.getHeight();
+	// fetch the source image in greyscale:
 	heights = new float[W * H];
+	for (int y = 0; y < H; y++)
+		for (int x = 0; x < W; x++)
+			heights[y * W + x] = bmp.getPixel(x, y).intensity();
+	// do we have blur? If yes, apply it to the heights:
+	if (blur > 0) gaussianBlur(heights, W, H, blur);
 	float minY = LARGE_FLOAT, maxY = -LARGE_FLOAT;
-	if (blur <= 0) {
-		for (int y = 0; y < H; y++)
-			for (int x = 0; x < W; x++) {
-				float h = bmp.getPixel(x, y).intensity();
-				heights[y * W + x] = h;
-				minY = min(minY, h);
-				maxY = max(maxY, h);
-			}
-	} else {
-		// We have blur...
-		// 1) convert image to greyscale (if not already):
-		for (int y = 0; y < H; y++) {
-			for (int x = 0; x < W; x++) {
-				float f = bmp.getPixel(x, y).intensity();
-				bmp.setPixel(x, y, Color(f, f, f));
-			}
-		}
-		// 2) calculate the gaussian coefficients, see http://en.wikipedia.org/wiki/Gaussian_blur
-		static float gauss[128][128];
-		int R = min(128, nearestInt(float(3 * blur)));
-		for (int y = 0; y < R; y++)
-			for (int x = 0; x < R; x++)
-				gauss[y][x] = float(exp(-(sqr(x) + sqr(y))/(2 * sqr(blur))) / (2 * PI * sqr(blur)));
-		// 3) apply gaussian blur with the specified number of blur units:
-		// (this is potentially slow for large blur radii)
-		for (int y = 0; y < H; y++) {
-			for (int x = 0; x < W; x++) {
-				float sum = 0;
-				for (int dy = -R + 1; dy < R; dy++)
-					for (int dx = -R + 1; dx < R; dx++)
-						sum += gauss[abs(dy)][abs(dx)] * bmp.getPixel(x + dx, y + dy).r;
-				heights[y * W + x] = sum;
-				minY = min(minY, sum);
-				maxY = max(maxY, sum);
-			}
-		}
+	for (int i = 0; i < W * H; i++) {
+		minY = min(minY, heights[i]);
+		maxY = max(maxY, heights[i]);
 	}
 	
 	bbox.vmin = Vector(0, minY, 0);
 	bbox.vmax = Vector(W, maxY, H);
 	
-	maxH = new float[W*H];
-	for (int y = 0; y < H; y++)
+	switch (normalStorage) {
+		case NORMALS_FULL:
+			normals = new Vector[W * H];
+			for (int y = 0; y < H; y++)
+				for (int x = 0; x < W; x++)
+					normals[y * W + x] = computeNormal(x, y);
+			break;
+		case NORMALS_OCTAHEDRAL:
+			packedNormals = new PackedNormal[W * H];
+			for (int y = 0; y < H; y++)
+				for (int x = 0; x < W; x++)
+					packedNormals[y * W + x] = packNormal(computeNormal(x, y));
+			break;
+		case NORMALS_COMPUTED:
+			break;
+	}
+}
+
+bool Heightfield::loadTiled(const char* filename)
+{
+	tiles = new HeightfieldTiles;
+	if (!tiles->open(filename, maxResidentTiles)) return false;
+	const TiledHeightfieldHeader& header = tiles->getHeader();
+	W = header.W;
+	H = header.H;
+	bbox.vmin = Vector(0, header.minY, 0);
+	bbox.vmax = Vector(W, header.maxY, H);
+	printf("Tiled heightfield %dx%d, %d tiles, at most %d in memory (%.1lf MB)\n", W, H,
+		header.tilesX * header.tilesY, maxResidentTiles, maxResidentTiles * double(header.tileStride) / 1048576.0);
+	return true;
+}
+
+/// Reads a heightmap image one row at a time, from the top, giving the heights (the intensity, optionally
+/// blurred) of each row. Only the rows, needed for the vertical pass of the blur, are kept in memory.
+class HeightmapRowStream {
+	ImageRowReader reader;
+	int W, H, R;
+	vector<float> kernel;
+	vector<Color> colors;
+	vector<float> intensity;
+	vector<float> window;        //!< the horizontally blurred rows, cyclically (2R - 1 of them)
+	vector<const float*> rows;   //!< the rows, around the current one (see blurRowVertical())
+	int nextRow;                 //!< the row, returned by the next call to next()
+	int rowsRead;                //!< how many rows are read in `window'
+	
+	bool readRow(int y, float* heights)
+	{
+		if (!reader.readRow(y, &colors[0])) return false;
+		for (int x = 0; x < W; x++) heights[x] = colors[x].intensity();
+		return true;
+	}
+public:
+	bool open(const char* filename, double blur)
+	{
+		if (!reader.open(filename)) return false;
+		W = reader.getWidth();
+		H = reader.getHeight();
+		R = blur > 0 ? gaussianKernel(blur, kernel) : 0;
+		colors.resize(W);
+		intensity.resize(W);
+		window.resize(size_t(max(1, 2 * R - 1)) * W);
+		rows.resize(max(1, 2 * R - 1));
+		nextRow = rowsRead = 0;
+		return true;
+	}
+	int getWidth(void) const { return W; }
+	int getHeight(void) const { return H; }
+	
+	/// gets the heights of the next row in heights[0..W-1]
+	bool next(float* heights)
+	{
+		int y = nextRow++;
+		if (!R) return readRow(y, heights);
+		int windowRows = 2 * R - 1;
+		while (rowsRead < min(H, y + R)) {
+			if (!readRow(rowsRead, &intensity[0])) return false;
+			blurRowHorizontal(&intensity[0], &window[size_t(rowsRead % windowRows) * W], W, &kernel[0], R);
+			rowsRead++;
+		}
+		for (int d = -R + 1; d < R; d++)
+			rows[R - 1 + d] = (y + d < 0 || y + d >= H) ? NULL : &window[size_t((y + d) % windowRows) * W];
+		blurRowVertical(&rows[0], heights, W, &kernel[0], R);
+		return true;
+	}
+};
+
+bool Heightfield::convertToTiled(const char* imageFile, double blur, const char* tiledFile)
+{
+	// The image is read twice: first to find the range of the heights, and then to quantize them
+	// and write the tiles. Only a row of tiles (and a few rows of the image for the blur) is in memory
+	// at any time, so the terrain may be larger than the RAM.
+	HeightmapRowStream stream;
+	if (!stream.open(imageFile, blur)) return false;
+	int W = stream.getWidth(), H = stream.getHeight();
+	if (W < 2 || H < 2) return false;
+	vector<float> row(W);
+	float minY = LARGE_FLOAT, maxY = -LARGE_FLOAT;
+	for (int y = 0; y < H; y++) {
+		if (!stream.next(&row[0])) return false;
 		for (int x = 0; x < W; x++) {
-			float& maxH = this->maxH[y * W + x];
-			maxH = heights[y * W + x];
-			if (x < W - 1) maxH = max(maxH, heights[y * W + x + 1]);
-			if (y < H - 1) {
-				maxH = max(maxH, heights[(y + 1) * W + x]);
-				if (x < W - 1)
-					maxH = max(maxH, heights[(y + 1) * W + x + 1]);
-			}
+			minY = min(minY, row[x]);
+			maxY = max(maxY, row[x]);
 		}
+	}
+	if (!stream.open(imageFile, blur)) return false;
+	
+	TiledHeightfieldHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, TILED_HEIGHTFIELD_MAGIC, 8);
+	header.version = TILED_HEIGHTFIELD_VERSION;
+	header.W = W;
+	header.H = H;
+	header.tilesX = (W + HEIGHTFIELD_TILE_SIZE - 1) / HEIGHTFIELD_TILE_SIZE;
+	header.tilesY = (H + HEIGHTFIELD_TILE_SIZE - 1) / HEIGHTFIELD_TILE_SIZE;
+	header.minY = minY;
+	header.maxY = maxY;
+	header.scaleY = header.maxY > header.minY ? (header.maxY - header.minY) / 65535 : 1;
+	header.tileStride = (tileValues() * 2 + 4095) / 4096 * 4096;
+	int numTiles = header.tilesX * header.tilesY;
+	header.tilesOffset = (sizeof(header) + numTiles * 2 + 4095) / 4096 * 4096;
+	
+	FILE* f = fopen(tiledFile, "wb");
+	if (!f) return false;
+	// the table of the tiles' maximums is written (again) at the end, when it's known:
+	vector<unsigned short> tileMax(numTiles, 0);
+	vector<char> padding(size_t(header.tilesOffset) - sizeof(header) - numTiles * 2, 0);
+	bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+	ok = ok && fwrite(tileMax.data(), 2, numTiles, f) == size_t(numTiles);
+	ok = ok && (padding.empty() || fwrite(padding.data(), 1, padding.size(), f) == padding.size());
 	
-	normals = new Vector[W * H];
-	for (int y = 0; y < H - 1; y++)
-		for (int x = 0; x < W - 1; x++) {
-			float h0 = heights[y * W + x];
-			float hdx = heights[y * W + x + 1];
-			float hdy = heights[(y + 1) * W + x];
-			Vector vdx = Vector(1, hdx - h0, 0);
-			Vector vdy = Vector(0, hdy - h0, 1);
-			Vector norm = vdy ^ vdx;
-			norm.normalize();
-			normals[y * W + x] = norm;
+	// the rows of the current row of tiles, plus the first row of the next one (for the voxels' maximums):
+	vector<float> band(size_t(HEIGHTFIELD_TILE_SIZE + 1) * W);
+	int bandRows = 0;
+	auto quantize = [&] (int x, int y) {
+		// (y is relative to the band; the parts of the edge tiles, which are outside, repeat the last row/column)
+		float h = band[size_t(min(bandRows - 1, y)) * W + min(W - 1, x)];
+		return (unsigned short) max(0, min(65535, nearestInt((h - header.minY) / header.scaleY)));
+	};
+	vector<unsigned short> records(size_t(header.tilesX) * header.tileStride / 2);
+	vector<unsigned short> voxelMax(HEIGHTFIELD_TILE_SIZE * HEIGHTFIELD_TILE_SIZE);
+	for (int ty = 0; ok && ty < header.tilesY; ty++) {
+		int y0 = ty * HEIGHTFIELD_TILE_SIZE;
+		int needed = min(H - y0, HEIGHTFIELD_TILE_SIZE + 1);
+		if (ty > 0) {
+			// the last row of the previous band is the first one of this band:
+			memcpy(&band[0], &band[size_t(HEIGHTFIELD_TILE_SIZE) * W], W * sizeof(float));
+			bandRows = 1;
 		}
-	// fill edges of the normals array:
-	for (int y = 0; y < H; y++) normals[y * W + W - 1] = normals[y * W + W - 2];
-	for (int x = 0; x < W; x++) normals[(H - 1) * W + x] = normals[(H - 2) * W + x];
+		while (ok && bandRows < needed) ok = stream.next(&band[size_t(bandRows++) * W]);
+		if (!ok) break;
+		std::fill(records.begin(), records.end(), 0);
+		for (int tx = 0; tx < header.tilesX; tx++) {
+			unsigned short* record = &records[size_t(tx) * header.tileStride / 2];
+			for (int y = 0; y < HEIGHTFIELD_TILE_SIZE; y++)
+				for (int x = 0; x < HEIGHTFIELD_TILE_SIZE; x++) {
+					int gx = min(W - 1, tx * HEIGHTFIELD_TILE_SIZE + x), by = min(H - 1 - y0, y);
+					record[y * HEIGHTFIELD_TILE_SIZE + x] = quantize(gx, by);
+					voxelMax[y * HEIGHTFIELD_TILE_SIZE + x] = max(max(quantize(gx, by), quantize(gx + 1, by)),
+					                                             max(quantize(gx, by + 1), quantize(gx + 1, by + 1)));
+				}
+			// the tile's max-height pyramid (the level HEIGHTFIELD_TILE_BITS is the whole tile):
+			const unsigned short* src = &voxelMax[0];
+			for (int k = 1; k <= HEIGHTFIELD_TILE_BITS; k++) {
+				int size = HEIGHTFIELD_TILE_SIZE >> k;
+				unsigned short* dest = k < HEIGHTFIELD_TILE_BITS ? record + tileLevelOffset(k) : &tileMax[ty * header.tilesX + tx];
+				for (int y = 0; y < size; y++)
+					for (int x = 0; x < size; x++)
+						dest[y * size + x] = max(max(src[(2 * y) * 2 * size + 2 * x], src[(2 * y) * 2 * size + 2 * x + 1]),
+						                         max(src[(2 * y + 1) * 2 * size + 2 * x], src[(2 * y + 1) * 2 * size + 2 * x + 1]));
+				src = dest;
+			}
+		}
+		ok = fwrite(records.data(), 2, records.size(), f) == records.size();
+	}
+	ok = ok && fseek(f, sizeof(header), SEEK_SET) == 0;
+	ok = ok && fwrite(tileMax.data(), 2, numTiles, f) == size_t(numTiles);
+	ok = (fclose(f) == 0) && ok;
+	return ok;
 }
 
 void Heightfield::beginRender()
 {
-	if (useOptimization) {
+	levelW[0] = W;
+	levelH[0] = H;
+	levelOffset[0] = 0;
+	numLevels = 1;
+	if (useOptimization && tiles) {
+		// the pyramid is in the file; just get the size of its levels:
+		while (levelW[numLevels - 1] > 1 || levelH[numLevels - 1] > 1) {
+			levelW[numLevels] = (levelW[numLevels - 1] + 1) / 2;
+			levelH[numLevels] = (levelH[numLevels - 1] + 1) / 2;
+			numLevels++;
+		}
+	} else if (useOptimization) {
 		Uint32 startBuild = SDL_GetTicks();
-		buildHighMap();
+		buildMaxMip();
 		Uint32 endBuild = SDL_GetTicks();
-		printf("Built %dx%d heightmap acceleration struct in %.2lfs.\n", W, H, (endBuild - startBuild) / 1000.0);
+		printf("Built %dx%d heightmap acceleration struct (%d levels) in %.2lfs.\n", W, H, numLevels,
+			(endBuild - startBuild) / 1000.0);
 	}
 }
@@ -24,34 +24,151 @@
 #ifndef __HEIGHTFIELD_H__
 #define __HEIGHTFIELD_H__
 
+#include <vector>
+#include <atomic>
 #include "geometry.h"
 #include "bbox.h"
+#include "util.h"
+#include "cxxptl_sdl.h"
+
+#define MAX_HEIGHTFIELD_LEVELS 32
+#define HEIGHTFIELD_TILE_BITS  8
+#define HEIGHTFIELD_TILE_SIZE  (1 << HEIGHTFIELD_TILE_BITS)
+
+/**
+ * The header of a tiled heightfield file (.qdhf; see Heightfield::convertToTiled()). After it, there's the
+ * table of the tiles' maximums (unsigned short, tilesX * tilesY), and then, from tilesOffset on, the tiles.
+ * A tile has HEIGHTFIELD_TILE_SIZE^2 samples, followed by the levels 1..HEIGHTFIELD_TILE_BITS-1 of the
+ * max-height pyramid of its voxels. All values are 16-bit; a value of q means a height of minY + q * scaleY.
+ */
+struct TiledHeightfieldHeader {
+	char magic[8];         //!< "QDHFIELD"
+	int version;
+	int W, H;              //!< the size of the heightfield, in samples
+	int tilesX, tilesY;
+	float minY, maxY, scaleY;
+	int tileStride;        //!< the size of a tile record, in bytes (whole pages)
+	long long tilesOffset;
+	int reserved[8];
+};
+
+/**
+ * @brief The samples of a heightfield, paged in from a tiled file, as needed.
+ *
+ * The file is memory-mapped; the tiles, used during rendering, are tracked in an (approximate) LRU list,
+ * and when there are more than maxResident of them, the least recently used one is dropped from memory.
+ */
+class HeightfieldTiles {
+	MappedFile file;
+	const TiledHeightfieldHeader* header;
+	const unsigned short* tileMax;
+	std::vector<float> topLevels;    //!< the levels >= HEIGHTFIELD_TILE_BITS of the max-height pyramid
+	int topLevelOffset[MAX_HEIGHTFIELD_LEVELS], topLevelW[MAX_HEIGHTFIELD_LEVELS];
+	
+	int maxResident;
+	/*
+	 * The LRU stamps are relaxed atomics, so the tiles, which are already resident, are marked as used
+	 * without taking the lock; it's only needed for page-ins (and evictions).
+	 */
+	mutable Mutex lock;
+	mutable std::vector<std::atomic<unsigned> > lastUse; //!< per tile, the value of useClock at the last access (0: not resident)
+	mutable std::vector<int> residentTiles;              //!< (guarded by `lock')
+	mutable std::atomic<unsigned> useClock;              //!< advanced on each tile page-in
+	mutable int pageIns;
+	
+	void pageIn(int tile) const;
+	const unsigned short* getTile(int tile) const
+	{
+		unsigned clock = useClock.load(std::memory_order_relaxed);
+		unsigned stamp = lastUse[tile].load(std::memory_order_relaxed);
+		// (the exchange fails if the tile got evicted meanwhile; then it has to be paged in again)
+		if (stamp != clock && (stamp == 0 || !lastUse[tile].compare_exchange_strong(stamp, clock, std::memory_order_relaxed)))
+			pageIn(tile);
+		return (const unsigned short*) ((const char*) file.data() + header->tilesOffset +
+		                                size_t(tile) * header->tileStride);
+	}
+	float decode(unsigned short q) const { return header->minY + q * header->scaleY; }
+public:
+	HeightfieldTiles();
+	bool open(const char* filename, int maxResident);
+	const TiledHeightfieldHeader& getHeader() const { return *header; }
+	int getPageIns() const { return pageIns; }
+	/// gets the sample at (x, y), which must be inside the heightfield
+	float getHeight(int x, int y) const
+	{
+		const unsigned short* tile = getTile((y >> HEIGHTFIELD_TILE_BITS) * header->tilesX + (x >> HEIGHTFIELD_TILE_BITS));
+		return decode(tile[((y & (HEIGHTFIELD_TILE_SIZE - 1)) << HEIGHTFIELD_TILE_BITS) + (x & (HEIGHTFIELD_TILE_SIZE - 1))]);
+	}
+	/// the same as Heightfield's max-height pyramid, for levels > 0
+	float getCellMax(int level, int cx, int cy) const;
+};
+
+/// A unit vector in octahedral encoding, with 16 bits per coordinate (see Heightfield::normalStorage)
+struct PackedNormal {
+	unsigned short u, v;
+};
 
 class Heightfield: public Geometry {
-	float* heights, *maxH;
+	float* heights;
 	Vector* normals;
+	PackedNormal* packedNormals;
+	/**
+	 * How are the normals at the samples kept:
+	 * NORMALS_FULL: precomputed, as Vector-s (24 bytes per sample);
+	 * NORMALS_OCTAHEDRAL: precomputed, packed in 4 bytes per sample, with a small error (< 0.004 degrees);
+	 * NORMALS_COMPUTED: not stored at all; computed from the heights at the hit point. The same image as
+	 *                   NORMALS_FULL, but a bit more work per hit.
+	 * (the tiled heightfields always use NORMALS_COMPUTED)
+	 */
+	enum NormalStorage {
+		NORMALS_FULL,
+		NORMALS_OCTAHEDRAL,
+		NORMALS_COMPUTED,
+	} normalStorage;
 	BBox bbox;
 	int W, H;
 	float getHeight(int x, int y) const;
-	float getHighest(int x, int y, int k) const;
+	Vector computeNormal(int x, int y) const;
 	Vector getNormal(float x, float y) const;
 	
+	HeightfieldTiles* tiles; //!< if the heightfield is loaded from a tiled file, the samples are there
+	int maxResidentTiles;
+	
 	bool useOptimization;
-	struct HighStruct {
-		float h[16];
-	};
-	HighStruct* highMap;
-	int maxK;
+	/**
+	 * A max-height pyramid: the cell (x, y) at level k covers the 2^k x 2^k voxels from (x * 2^k, y * 2^k),
+	 * and holds the highest point in them. Level 0 isn't stored (it's the max of the four corners of the voxel,
+	 * which are read anyway); the rest of the levels are stored one after another in maxMip[] (about a third
+	 * of the size of heights[]).
+	 */
+	float* maxMip;
+	int numLevels;
+	int levelW[MAX_HEIGHTFIELD_LEVELS], levelH[MAX_HEIGHTFIELD_LEVELS];
+	int levelOffset[MAX_HEIGHTFIELD_LEVELS]; //!< the start of each level (> 0) in maxMip[]
+	float* getLevel(int k) const { return maxMip + levelOffset[k]; } //!< k > 0
+	float getCellMax(int level, int cx, int cy) const;
 	
-	void buildHighMap();
+	void buildMaxMip();
+	void loadFromBitmap(const Bitmap& bmp, double blur);
+	bool loadTiled(const char* filename);
+	bool march(const RRay& ray, double maxDist, double& hitDist) const;
+	friend class ParallelMipBuilder;
 	
 public:
 	Heightfield();
 	~Heightfield();
 	void beginRender();
 	bool intersect(const Ray& ray, IntersectionInfo& info);
+	bool intersectAny(const Ray& ray, double maxDist);
+	bool findHit(const Ray& ray, double maxDist, HitRecord& hit);
+	void computeSurface(const Ray& ray, const HitRecord& hit, IntersectionInfo& info);
 	bool isInside(const Vector& p ) const { return false; }
+	bool getBBox(BBox& bbox) const { bbox = this->bbox; return true; }
 	void fillProperties(ParsedBlock& pb);
+	
+	/// converts a heightmap image to a tiled heightfield file (.qdhf), which can be rendered out-of-core.
+	/// The image is streamed, so it doesn't need to fit in memory
+	static bool convertToTiled(const char* imageFile, double blur, const char* tiledFile);
 };
 
 #endif // __HEIGHTFIELD_H__
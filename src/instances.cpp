@@ -0,0 +1,267 @@
+/***************************************************************************
+ *   Copyright (C) 2009-2015 by Veselin Georgiev, Slavomir Kaslev et al    *
+ *   admin@raytracing-bg.net                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+/**
+ * @File instances.cpp
+ * @Brief Implementation of the Instances geometry.
+ */
+#include <stdio.h>
+#include <SDL/SDL.h>
+#include "instances.h"
+#include "constants.h"
+#include "random_generator.h"
+using std::vector;
+
+void InstanceTransform::set(const Transform& transform)
+{
+	// the i-th row of the inverse matrix is the transformed i-th basis vector:
+	for (int i = 0; i < 3; i++) {
+		Vector row = transform.undoDirection(Vector(i == 0, i == 1, i == 2));
+		for (int j = 0; j < 3; j++)
+			inverse[i][j] = float(row[j]);
+	}
+	Vector origin = transform.point(Vector(0, 0, 0));
+	for (int i = 0; i < 3; i++)
+		offset[i] = float(origin[i]);
+}
+
+Matrix InstanceTransform::getInverse() const
+{
+	Matrix result;
+	for (int i = 0; i < 3; i++)
+		for (int j = 0; j < 3; j++)
+			result.m[i][j] = inverse[i][j];
+	return result;
+}
+
+Ray Instances::toInstanceSpace(int idx, const Ray& ray, double& rayDirLength) const
+{
+	const InstanceTransform& T = transforms[idx];
+	Matrix inverse = T.getInverse();
+	Ray result = ray;
+	result.start = (ray.start - T.getOffset()) * inverse;
+	result.dir = ray.dir * inverse;
+	rayDirLength = result.dir.length();
+	result.dir.normalize();
+	return result;
+}
+
+bool Instances::loadInstances(const char* filename)
+{
+	FILE* f = fopen(filename, "rt");
+	if (!f) return false;
+	char line[1024];
+	int lineNumber = 0;
+	while (fgets(line, sizeof(line), f)) {
+		lineNumber++;
+		double v[9];
+		int n = sscanf(line, "%lf%lf%lf%lf%lf%lf%lf%lf%lf", &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7], &v[8]);
+		if (n <= 0) continue; // empty lines, comments
+		if (n != 3 && n != 6 && n != 7 && n != 9) {
+			printf("%s:%d: expected \"x y z [yaw pitch roll [scale | sx sy sz]]\", got %d values\n", filename,
+			       lineNumber, n);
+			fclose(f);
+			return false;
+		}
+		// the same order as in a Node block: scale, then rotate (so that a non-uniform scale is along the
+		// geometry's own axes), then translate:
+		Transform T;
+		if (n == 7) T.scale(v[6], v[6], v[6]);
+		if (n == 9) T.scale(v[6], v[7], v[8]);
+		if (n >= 6) T.rotate(v[3], v[4], v[5]);
+		T.translate(Vector(v[0], v[1], v[2]));
+		InstanceTransform instance;
+		instance.set(T);
+		transforms.push_back(instance);
+	}
+	fclose(f);
+	return true;
+}
+
+void Instances::scatterInstances(int count, unsigned seed, const Vector& scatterMin, const Vector& scatterMax,
+                                 double minScale, double maxScale, bool randomRotation)
+{
+	Random rnd(seed);
+	transforms.reserve(transforms.size() + count);
+	for (int i = 0; i < count; i++) {
+		Vector pos;
+		for (int dim = 0; dim < 3; dim++)
+			pos[dim] = scatterMin[dim] + (scatterMax[dim] - scatterMin[dim]) * rnd.randdouble();
+		double scale = minScale + (maxScale - minScale) * rnd.randdouble();
+		double yaw = randomRotation ? rnd.randdouble() * 360 : 0;
+		Transform T;
+		T.scale(scale, scale, scale);
+		if (randomRotation) T.rotate(yaw, 0, 0);
+		T.translate(pos);
+		InstanceTransform instance;
+		instance.set(T);
+		transforms.push_back(instance);
+	}
+}
+
+void Instances::fillProperties(ParsedBlock& pb)
+{
+	pb.requiredProp("geometry");
+	pb.getGeometryProp("geometry", &geom);
+	if (dynamic_cast<Instances*>(geom))
+		pb.signalError("Instances of Instances aren't supported");
+	char fn[256];
+	if (pb.getFilenameProp("file", fn) && !loadInstances(fn))
+		pb.signalError("Could not load the instances file!");
+	int count = 0;
+	pb.getIntProp("count", &count, 0);
+	if (count > 0) {
+		int seed = 42;
+		Vector scatterMin(0, 0, 0), scatterMax(0, 0, 0);
+		double minScale = 1, maxScale = 1;
+		bool randomRotation = true;
+		pb.getIntProp("seed", &seed);
+		pb.getVectorProp("scatterMin", &scatterMin);
+		pb.getVectorProp("scatterMax", &scatterMax);
+		pb.getDoubleProp("minScale", &minScale, 1e-6);
+		pb.getDoubleProp("maxScale", &maxScale, minScale);
+		pb.getBoolProp("randomRotation", &randomRotation);
+		scatterInstances(count, unsigned(seed), scatterMin, scatterMax, minScale, maxScale, randomRotation);
+	}
+	if (transforms.empty())
+		pb.signalError("No instances given (use `file' and/or `count')");
+}
+
+void Instances::beginRender()
+{
+	Uint32 startBuild = SDL_GetTicks();
+	BBox geomBBox;
+	if (!geom->getBBox(geomBBox)) {
+		printf("Instances: the instanced geometry is unbounded, ignoring the instances\n");
+		vector<InstanceTransform>().swap(transforms);
+	}
+	// the world-space box of each instance is the box around its transformed geometry box corners:
+	vector<BBox> boxes(transforms.size());
+	bbox.makeEmpty();
+	for (int i = 0; i < (int) transforms.size(); i++) {
+		Matrix forward = inverseMatrix(transforms[i].getInverse());
+		Vector offset = transforms[i].getOffset();
+		boxes[i].makeEmpty();
+		for (int mask = 0; mask < 8; mask++) {
+			Vector corner(
+				(mask & 1) ? geomBBox.vmax.x : geomBBox.vmin.x,
+				(mask & 2) ? geomBBox.vmax.y : geomBBox.vmin.y,
+				(mask & 4) ? geomBBox.vmax.z : geomBBox.vmin.z);
+			boxes[i].add(corner * forward + offset);
+		}
+		// enlarge a bit, to account for the rounding of the compact transforms:
+		Vector eps = (boxes[i].vmax - boxes[i].vmin) * 1e-5 + Vector(1e-6, 1e-6, 1e-6);
+		boxes[i].vmin = boxes[i].vmin - eps;
+		boxes[i].vmax = boxes[i].vmax + eps;
+		bbox.add(boxes[i].vmin);
+		bbox.add(boxes[i].vmax);
+	}
+	bvh.build(boxes);
+	printf("Instances: %d instances, BVH with %d nodes, built in %.2lfs (%.1lf MB)\n", int(transforms.size()),
+		bvh.getNumNodes(), (SDL_GetTicks() - startBuild) / 1000.0,
+		(transforms.size() * sizeof(InstanceTransform) + bvh.memoryUsage()) / 1048576.0);
+}
+
+bool Instances::intersect(const Ray& ray, IntersectionInfo& info)
+{
+	HitRecord hit;
+	if (!findHit(ray, INF, hit)) return false;
+	computeSurface(ray, hit, info);
+	return true;
+}
+
+bool Instances::findHit(const Ray& ray, double maxDist, HitRecord& hit)
+{
+	RRay rray(ray);
+	rray.prepareForTracing();
+	bool found = false;
+	bvh.traverse(rray, maxDist, [&] (int item, double& maxDist) {
+		double rayDirLength;
+		Ray rayInstance = toInstanceSpace(item, ray, rayDirLength);
+		HitRecord instanceHit;
+		// (see Node::findHit() about the widened bound)
+		if (geom->findHit(rayInstance, maxDist * rayDirLength * (1 + 1e-9), instanceHit)) {
+			double distance = instanceHit.distance / rayDirLength;
+			if (distance < maxDist) {
+				maxDist = distance;
+				hit = instanceHit;
+				hit.distance = distance;
+				hit.instance = item;
+				hit.instanceDistance = instanceHit.distance;
+				found = true;
+			}
+		}
+		return false;
+	});
+	return found;
+}
+
+int Instances::findAllHits(const Ray& ray, HitRecord hits[], int maxHits)
+{
+	int n = Geometry::findAllHits(ray, hits, maxHits);
+	// the hits were found along rays, which start further along `ray', so their distances in the instances'
+	// space are recomputed from the start of `ray':
+	for (int i = 0; i < n; i++) {
+		double rayDirLength;
+		toInstanceSpace(hits[i].instance, ray, rayDirLength);
+		hits[i].instanceDistance = hits[i].distance * rayDirLength;
+	}
+	return n;
+}
+
+bool Instances::intersectAny(const Ray& ray, double maxDist)
+{
+	RRay rray(ray);
+	rray.prepareForTracing();
+	return bvh.traverse(rray, maxDist, [&] (int item, double& maxDist) {
+		double rayDirLength;
+		Ray rayInstance = toInstanceSpace(item, ray, rayDirLength);
+		return geom->intersectAny(rayInstance, maxDist * rayDirLength);
+	});
+}
+
+void Instances::computeSurface(const Ray& ray, const HitRecord& hit, IntersectionInfo& info)
+{
+	double rayDirLength;
+	Ray rayInstance = toInstanceSpace(hit.instance, ray, rayDirLength);
+	HitRecord instanceHit = hit;
+	instanceHit.distance = hit.instanceDistance;
+	geom->computeSurface(rayInstance, instanceHit, info);
+	
+	// back to our space (the same as Node::toWorldSpace()):
+	const InstanceTransform& T = transforms[hit.instance];
+	Matrix inverse = T.getInverse();
+	Matrix forward = inverseMatrix(inverse);
+	info.normal = info.normal * transpose(inverse);
+	info.dNdx = info.dNdx * forward;
+	info.dNdy = info.dNdy * forward;
+	info.normal.normalize();
+	info.dNdx.normalize();
+	info.dNdy.normalize();
+	info.ip = info.ip * forward + T.getOffset();
+	info.distance = hit.distance;
+	info.geom = this;
+}
+
+bool Instances::getBBox(BBox& bbox) const
+{
+	if (transforms.empty()) return false;
+	bbox = this->bbox;
+	return true;
+}
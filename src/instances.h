@@ -0,0 +1,78 @@
+/***************************************************************************
+ *   Copyright (C) 2009-2015 by Veselin Georgiev, Slavomir Kaslev et al    *
+ *   admin@raytracing-bg.net                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+/**
+ * @File instances.h
+ * @Brief Contains the Instances geometry class (many transformed copies of a single geometry).
+ */
+#ifndef __INSTANCES_H__
+#define __INSTANCES_H__
+
+#include <vector>
+#include "geometry.h"
+#include "matrix.h"
+#include "bvh.h"
+
+/// The compact transform of a single instance: a world-space point P is at (P - offset) * inverse in the
+/// instanced geometry's space
+struct InstanceTransform {
+	float inverse[3][3];
+	float offset[3];
+	
+	void set(const Transform& transform);
+	Matrix getInverse() const;
+	Vector getOffset() const { return Vector(offset[0], offset[1], offset[2]); }
+};
+
+/**
+ * @class Instances
+ * @brief Places many copies of a geometry, each with its own transform.
+ *
+ * Only a compact transform is stored per instance; the instanced geometry (and its acceleration structure,
+ * e.g. a mesh's KD tree) is shared. A BVH over the instances' boxes finds the candidate instances for a ray.
+ * The instances are listed in a text file (one per line: "x y z [yaw pitch roll [scale | sx sy sz]]"),
+ * or scattered randomly in a box; both can be given. A node with an Instances geometry renders all of them.
+ */
+class Instances: public Geometry {
+	std::vector<InstanceTransform> transforms;
+	BVH bvh;
+	BBox bbox;
+	
+	/// transforms a ray to the space of the idx-th instance; rayDirLength gets the length of the transformed direction
+	Ray toInstanceSpace(int idx, const Ray& ray, double& rayDirLength) const;
+	bool loadInstances(const char* filename);
+	void scatterInstances(int count, unsigned seed, const Vector& scatterMin, const Vector& scatterMax,
+	                      double minScale, double maxScale, bool randomRotation);
+public:
+	Geometry* geom; //!< the instanced geometry
+	
+	Instances() { geom = NULL; }
+	void fillProperties(ParsedBlock& pb);
+	void beginRender();
+	
+	bool intersect(const Ray& ray, IntersectionInfo& info);
+	bool intersectAny(const Ray& ray, double maxDist);
+	/// the hit record has the instance index and the distance in its space, besides the instanced geometry's data
+	bool findHit(const Ray& ray, double maxDist, HitRecord& hit);
+	int findAllHits(const Ray& ray, HitRecord hits[], int maxHits);
+	void computeSurface(const Ray& ray, const HitRecord& hit, IntersectionInfo& info);
+	bool getBBox(BBox& bbox) const;
+};
+
+#endif // __INSTANCES_H__
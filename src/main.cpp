@@ -1,6 +1,7 @@
 #include <SDL/SDL.h>
 #include <SDL/SDL_events.h>
 #include <math.h>
+#include <string.h>
 #include <vector>
 #include "vector.h"
 #include "util.h"
@@ -11,36 +12,46 @@
 #include "shading.h"
 #include "environment.h"
 #include "mesh.h"
+#include "heightfield.h"
 #include "random_generator.h"
 #include "scene.h"
 #include "lights.h"
 #include "cxxptl_sdl.h"
+#include "scheduler.h"
 
 using std::vector;
 
 
-Color vfb[VFB_MAX_SIZE][VFB_MAX_SIZE];
-bool needsAA[VFB_MAX_SIZE][VFB_MAX_SIZE];
+FrameBuffer vfb;
+TiledBuffer<bool> needsAA;
+
+/// the sums of the clamped intensities of the samples of a pixel, and of their squares (for the noise estimate)
+struct NoiseSums {
+	float sum, sumSq;
+};
+
+// progressive rendering: the sums of all samples of each pixel so far
+static FrameBuffer accumBuffer;
+static TiledBuffer<NoiseSums> noiseBuffer;
 
 bool visibilityCheck(const Vector& start, const Vector& end);
 ThreadPool pool;
 
-Color raytrace(const Ray& ray)
+/// the cost of the prepass block, which is being traced by this thread (NULL outside of the prepass)
+static thread_local BlockCost* traceStats = NULL;
+
+static inline void countRay(const Ray& ray)
 {
-	if (ray.depth > scene.settings.maxTraceDepth) return Color(0, 0, 0);
-	Node* closestNode = NULL;
-	double closestDist = INF;
-	IntersectionInfo closestInfo;
-	for (auto& node: scene.nodes) {
-		IntersectionInfo info;
-		if (!node->intersect(ray, info)) continue;
-		
-		if (info.distance < closestDist) {
-			closestDist = info.distance;
-			closestNode = node;
-			closestInfo = info;
-		}
+	if (traceStats) {
+		traceStats->rays++;
+		traceStats->maxDepth = max(traceStats->maxDepth, ray.depth);
 	}
+}
+
+/// shades the closest intersection of a ray (closestNode is NULL if the ray didn't hit anything)
+Color shadeIntersection(const Ray& ray, Node* closestNode, IntersectionInfo& closestInfo)
+{
+	double closestDist = closestNode ? closestInfo.distance : INF;
 	// check if the closest intersection point is actually a light:
 	bool hitLight = false;
 	Color hitLightColor;
@@ -66,6 +77,15 @@ Color raytrace(const Ray& ray)
 	}
 }
 
+Color raytrace(const Ray& ray)
+{
+	if (ray.depth > scene.settings.maxTraceDepth) return Color(0, 0, 0);
+	countRay(ray);
+	IntersectionInfo closestInfo;
+	Node* closestNode = scene.intersect(ray, closestInfo);
+	return shadeIntersection(ray, closestNode, closestInfo);
+}
+
 Color explicitLightSample(const Ray& ray, const IntersectionInfo& info, const Color& pathMultiplier, Shader* shader, Random& rnd)
 {
 	// try to end a path by explicitly sampling a light. If there are no lights, we can't do that:
@@ -123,19 +143,10 @@ Color pathtrace(Ray ray, const Color& pathMultiplier, Random& rnd)
 {
 	if (ray.depth > scene.settings.maxTraceDepth) return Color(0, 0, 0);
 	if (pathMultiplier.intensity() < 0.001f) return Color(0, 0, 0);
-	Node* closestNode = NULL;
-	double closestDist = INF;
+	countRay(ray);
 	IntersectionInfo closestInfo;
-	for (auto& node: scene.nodes) {
-		IntersectionInfo info;
-		if (!node->intersect(ray, info)) continue;
-		
-		if (info.distance < closestDist) {
-			closestDist = info.distance;
-			closestNode = node;
-			closestInfo = info;
-		}
-	}
+	Node* closestNode = scene.intersect(ray, closestInfo);
+	double closestDist = closestNode ? closestInfo.distance : INF;
 	// check if the closest intersection point is actually a light:
 	bool hitLight = false;
 	Color hitLightColor;
@@ -193,15 +204,8 @@ bool visibilityCheck(const Vector& start, const Vector& end)
 	
 	double targetDist = (end - start).length();
 	
-	for (auto& node: scene.nodes) {
-		IntersectionInfo info;
-		if (!node->intersect(ray, info)) continue;
-		
-		if (info.distance < targetDist) {
-			return false;
-		}
-	}
-	return true;
+	countRay(ray);
+	return !scene.intersectAny(ray, targetDist);
 }
 
 void debugRayTrace(int x, int y)
@@ -248,6 +252,29 @@ Color raytraceSinglePixel(double x, double y)
 	}
 }
 
+/// renders the pixels of a 2x2 block at (x, y), which are inside the rect r, tracing the primary rays as a packet
+void renderPixelPacket(int x, int y, const Rect& r)
+{
+	RayPacket packet;
+	int mask = 0;
+	for (int i = 0; i < RayPacket::SIZE; i++) {
+		int px = x + (i & 1), py = y + (i >> 1);
+		if (px < r.x1 && py < r.y1) {
+			packet.rays[i] = RRay(scene.camera->getScreenRay(px, py));
+			mask |= 1 << i;
+		} else {
+			packet.rays[i] = packet.rays[0];
+		}
+	}
+	packet.prepareForTracing();
+	Node* closestNodes[RayPacket::SIZE];
+	IntersectionInfo closestInfo[RayPacket::SIZE];
+	scene.intersectPacket(packet, mask, closestNodes, closestInfo);
+	for (int i = 0; i < RayPacket::SIZE; i++)
+		if (mask & (1 << i))
+			vfb.at(x + (i & 1), y + (i >> 1)) = shadeIntersection(packet.rays[i], closestNodes[i], closestInfo[i]);
+}
+
 Color renderDOFPixel(int x, int y)
 {
 	Random& rnd = getRandomGen();
@@ -274,6 +301,13 @@ Color renderGIPixel(int x, int y)
 	return sum / N;
 }
 
+/// a single sample of the pixel (x, y), at a random point inside it (for progressive rendering).
+/// raytraceSinglePixel() takes care of DOF, stereo and GI, as in the non-progressive render
+static Color renderSample(int x, int y, Random& rnd)
+{
+	return raytraceSinglePixel(x + rnd.randdouble(), y + rnd.randdouble());
+}
+
 Color renderPixel(int x, int y)
 {
 	if (scene.camera->dof) {
@@ -297,20 +331,20 @@ static void detectAApixels(const vector<Rect>& buckets)
 	for (auto& r: buckets) {
 		for (int y = r.y0; y < r.y1; y++)
 			for (int x = r.x0; x < r.x1; x++) {
-				needsAA[y][x] = false;
-				const Color& me = vfb[y][x];
+				needsAA.at(x, y) = false;
+				const Color& me = vfb.at(x, y);
 				for (int ni = 0; ni < COUNT_OF(neighbours); ni++) {
 					int neighX = x + neighbours[ni][0];
 					int neighY = y + neighbours[ni][1];
 					if (neighX < 0 || neighX >= W || neighY < 0 || neighY >= H) continue;
-					const Color& neighbour = vfb[neighY][neighX];
+					const Color& neighbour = vfb.at(neighX, neighY);
 					for (int channel = 0; channel < 3; channel++) {
 						if (fabs(min(1.0f, me[channel]) - min(1.0f, neighbour[channel])) > AA_THRESH) {
-							needsAA[y][x] = true;
+							needsAA.at(x, y) = true;
 							break;
 						}
 					}
-					if (needsAA[y][x]) break;
+					if (needsAA.at(x, y)) break;
 				}
 			}
 	}
@@ -319,10 +353,15 @@ static void detectAApixels(const vector<Rect>& buckets)
 
 class RenderScreenTask: public Parallel {
 protected:
-	const vector<Rect>& buckets;
-	InterlockedInt counter;
+	BucketScheduler scheduler;
+	bool showProgress; //!< display each bucket as it's rendered (not in interactive or in batch mode)
 public:
-	RenderScreenTask(const vector<Rect>& buckets): buckets(buckets), counter(0) {}
+	RenderScreenTask(const vector<Rect>& buckets, bool costOrdered):
+		scheduler(buckets, scene.settings.numThreads, costOrdered)
+	{
+		showProgress = !scene.settings.interactive && !isHeadless();
+	}
+	void printStats() { scheduler.printStats(); }
 };
 
 // Main rendering task. For scenes, that have implicit AA (with DOF or GI), this
@@ -330,22 +369,36 @@ public:
 // that renders the base screen (1-sample-per-pixel).
 struct MainRenderTask: public RenderScreenTask {
 	bool finalPass;
-	MainRenderTask(const vector<Rect>& buckets): RenderScreenTask(buckets)
+	bool usePackets; // packets are only used for plain (non-DOF, non-GI, non-stereo) primary rays
+	MainRenderTask(const vector<Rect>& buckets, bool costOrdered): RenderScreenTask(buckets, costOrdered)
 	{
 		finalPass = !scene.settings.needAApass();
+		usePackets = scene.settings.packetTracing && !scene.camera->dof && !scene.settings.gi
+		             && scene.camera->stereoSeparation <= 0;
 	}
 	
 	void entry(int threadIdx, int threadCount)
 	{
-		int i;
-		while ((i = counter++) < int(buckets.size())) {
-			const Rect& r = buckets[i];
-			if (!scene.settings.interactive && finalPass && !markRegion(r)) return;
-			for (int y = r.y0; y < r.y1; y++)
-				for (int x = r.x0; x < r.x1; x++) {
-					vfb[y][x] = renderPixel(x, y);
-				}
-			if (!scene.settings.interactive && !displayVFBRect(r, vfb)) return;
+		Rect r;
+		while (scheduler.getBucket(threadIdx, r)) {
+			if (showProgress && finalPass && !markRegion(r)) {
+				scheduler.abort();
+				return;
+			}
+			if (usePackets) {
+				for (int y = r.y0; y < r.y1; y += 2)
+					for (int x = r.x0; x < r.x1; x += 2)
+						renderPixelPacket(x, y, r);
+			} else {
+				for (int y = r.y0; y < r.y1; y++)
+					for (int x = r.x0; x < r.x1; x++) {
+						vfb.at(x, y) = renderPixel(x, y);
+					}
+			}
+			if (showProgress && !displayVFBRect(r, vfb)) {
+				scheduler.abort();
+				return;
+			}
 		}
 	}
 };
@@ -353,12 +406,12 @@ struct MainRenderTask: public RenderScreenTask {
 // If explicit AA is needed, this task refines the image around sharp edges
 // (as detected by detectAApixels()).
 struct RefineRenderTask: public RenderScreenTask {
-	RefineRenderTask(const vector<Rect>& buckets): RenderScreenTask(buckets) {}
+	RefineRenderTask(const vector<Rect>& buckets, bool costOrdered): RenderScreenTask(buckets, costOrdered) {}
 	
 	void entry(int threadIdx, int threadCount)
 	{
 		const double kernel[5][2] = {
-			// note that this sample is already rendered in vfb[][]:
+			// note that this sample is already rendered in the VFB (vfb.at(x, y)):
 			{ 0.0, 0.0 }, 
 			
 			// refinement adds these samples:
@@ -367,63 +420,230 @@ struct RefineRenderTask: public RenderScreenTask {
 			{ 0.3, 0.3 },
 			{ 0.6, 0.6 },
 		};
-		int i;
-		while ((i = counter++) < int(buckets.size())) {
-			const Rect& r = buckets[i];
+		Rect r;
+		while (scheduler.getBucket(threadIdx, r)) {
 			// see if the bucket contains anything interesting at all:
 			bool skipBucket = true;
 			for (int y = r.y0; y < r.y1 && skipBucket; y++)
 				for (int x = r.x0; x < r.x1; x++) 
-					if (needsAA[y][x]) {
+					if (needsAA.at(x, y)) {
 						skipBucket = false;
 						break;
 					}
 			if (skipBucket) continue;
 			
-			if (!markRegion(r)) return;
+			if (showProgress && !markRegion(r)) {
+				scheduler.abort();
+				return;
+			}
 			for (int y = r.y0; y < r.y1; y++)
 				for (int x = r.x0; x < r.x1; x++) {
-					if (!needsAA[y][x]) continue;
-					Color& sum = vfb[y][x];
+					if (!needsAA.at(x, y)) continue;
+					Color& sum = vfb.at(x, y);
 					for (int j = 1; j < COUNT_OF(kernel); j++)
 						sum += raytraceSinglePixel(x + kernel[j][0], y + kernel[j][1]);
 					sum /= COUNT_OF(kernel);
 				}
-			if (!scene.settings.interactive && !displayVFBRect(r, vfb)) return;
+			if (showProgress && !displayVFBRect(r, vfb)) {
+				scheduler.abort();
+				return;
+			}
 		}
 	}
 };
 
+// A single pass of the progressive rendering: adds one sample to each pixel of the accumulation buffer, and
+// puts the new averages in the vfb. Except in the first pass, no new buckets are taken after the deadline.
+struct ProgressiveRenderTask: public RenderScreenTask {
+	int numSamples;         //!< the samples per pixel, including this pass
+	double deadline;        //!< in getPreciseTime() terms; 0 = none
+	vector<double> noise;   //!< per thread: the sum of the pixels' standard errors
+	volatile bool aborted;  //!< the window was closed
+	volatile bool timedOut; //!< the deadline has passed before the pass was completed
+	
+	ProgressiveRenderTask(const vector<Rect>& buckets, bool costOrdered, int pass, double deadline):
+		RenderScreenTask(buckets, costOrdered), numSamples(pass + 1), deadline(deadline),
+		noise(scene.settings.numThreads, 0.0), aborted(false), timedOut(false) {}
+	
+	void entry(int threadIdx, int threadCount)
+	{
+		Random& rnd = getRandomGen();
+		Rect r;
+		while (scheduler.getBucket(threadIdx, r)) {
+			if (deadline > 0 && numSamples > 1 && getPreciseTime() > deadline) {
+				timedOut = true;
+				scheduler.abort();
+				return;
+			}
+			int n = numSamples;
+			for (int y = r.y0; y < r.y1; y++)
+				for (int x = r.x0; x < r.x1; x++) {
+					Color c = renderSample(x, y, rnd);
+					Color& sum = accumBuffer.at(x, y);
+					sum += c;
+					vfb.at(x, y) = sum / n;
+					// estimate the noise of the displayed value:
+					NoiseSums& ns = noiseBuffer.at(x, y);
+					float v = min(1.0f, c.intensity());
+					ns.sum += v;
+					ns.sumSq += v * v;
+					if (n > 1) {
+						float mean = ns.sum / n;
+						float variance = max(0.0f, (ns.sumSq - n * mean * mean) / (n - 1));
+						noise[threadIdx] += sqrt(variance / n);
+					}
+				}
+			if (showProgress && !displayVFBRect(r, vfb)) {
+				aborted = true;
+				scheduler.abort();
+				return;
+			}
+		}
+	}
+	/// the average standard error of the pixels' intensity (valid after a complete pass, with 2+ samples)
+	double getNoise() const
+	{
+		double sum = 0;
+		for (auto& threadSum: noise) sum += threadSum;
+		return sum / (double(frameWidth()) * frameHeight());
+	}
+};
+
+/// The coarse prepass: traces a single ray per block of PREPASS_BLOCK_SIZE^2 pixels, and records the block's cost.
+/// The buckets are split among the threads, and each one is displayed at once, when all of its blocks are done.
+class PrepassTask: public Parallel {
+	const vector<Rect>& buckets;
+	vector<BlockCost>& costs;
+	int blocksPerRow;
+	InterlockedInt counter;
+	volatile bool aborted;
+	bool showProgress;
+public:
+	PrepassTask(const vector<Rect>& buckets, vector<BlockCost>& costs, int blocksPerRow):
+		buckets(buckets), costs(costs), blocksPerRow(blocksPerRow), counter(0), aborted(false)
+	{
+		showProgress = !isHeadless();
+	}
+	bool wasAborted() const { return aborted; }
+	void entry(int threadIdx, int threadCount)
+	{
+		const int B = PREPASS_BLOCK_SIZE;
+		int i;
+		while (!aborted && (i = counter++) < int(buckets.size())) {
+			const Rect& r = buckets[i];
+			for (int dy = 0; dy < r.h; dy += B) {
+				int ey = min(r.h, dy + B);
+				for (int dx = 0; dx < r.w; dx += B) {
+					int ex = min(r.w, dx + B);
+					BlockCost& cost = costs[(r.y0 + dy) / B * blocksPerRow + (r.x0 + dx) / B];
+					traceStats = &cost;
+					double startTime = getPreciseTime();
+					Color c = raytraceSinglePixel(r.x0 + (dx + ex) / 2, r.y0 + (dy + ey) / 2);
+					cost.seconds = getPreciseTime() - startTime;
+					traceStats = NULL;
+					// (the main pass overwrites these)
+					for (int y = r.y0 + dy; y < r.y0 + ey; y++)
+						for (int x = r.x0 + dx; x < r.x0 + ex; x++)
+							vfb.at(x, y) = c;
+				}
+			}
+			if (showProgress && !displayVFBRect(r, vfb)) aborted = true;
+		}
+	}
+};
+
+/// renders progressively, one sample per pixel per pass, until the time budget, the target sample count
+/// or the noise threshold (as set in GlobalSettings) is reached
+static void renderProgressive(const vector<Rect>& buckets, bool costOrdered)
+{
+	const int MIN_SAMPLES_FOR_NOISE = 4; // the noise estimate of fewer samples is unreliable
+	GlobalSettings& settings = scene.settings;
+	accumBuffer.init(frameWidth(), frameHeight());
+	accumBuffer.fill(Color(0, 0, 0));
+	NoiseSums zero = { 0, 0 };
+	noiseBuffer.init(frameWidth(), frameHeight());
+	noiseBuffer.fill(zero);
+	
+	double startTime = getPreciseTime();
+	double deadline = settings.timeBudget > 0 ? startTime + settings.timeBudget : 0;
+	int samples = 0;
+	double noise = 0;
+	const char* reason;
+	while (1) {
+		ProgressiveRenderTask task(buckets, costOrdered, samples, deadline);
+		pool.run(&task, settings.numThreads);
+		if (task.aborted) return;
+		if (task.timedOut) {
+			reason = "time budget";
+			break;
+		}
+		samples++;
+		if (samples > 1) noise = task.getNoise();
+		if (settings.targetSamples > 0 && samples >= settings.targetSamples) {
+			reason = "target sample count";
+			break;
+		}
+		if (settings.noiseThreshold > 0 && samples >= MIN_SAMPLES_FOR_NOISE && noise < settings.noiseThreshold) {
+			reason = "noise threshold";
+			break;
+		}
+		if (deadline > 0 && getPreciseTime() >= deadline) {
+			reason = "time budget";
+			break;
+		}
+	}
+	printf("Progressive: %d samples per pixel in %.2fs, noise %.4f (stopped by the %s)\n", samples,
+		getPreciseTime() - startTime, noise, reason);
+}
+
 void render()
 {
 	scene.beginFrame();
 	vector<Rect> buckets = getBucketsList();
+	bool costOrdered = false;
 	
 	if (!scene.settings.interactive && (scene.settings.wantPrepass || scene.settings.gi)) {
 		// We render the whole screen in three passes.
-		// 1) First pass - use very coarse resolution rendering, tracing a single ray for a 16x16 block:
-		for (Rect& r: buckets) {
-			for (int dy = 0; dy < r.h; dy += 16) {
-				int ey = min(r.h, dy + 16);
-				for (int dx = 0; dx < r.w; dx += 16) {
-					int ex = min(r.w, dx + 16);
-					Color c = raytraceSinglePixel(r.x0 + dx + ex / 2, r.y0 + dy + ey / 2);
-					if (!drawRect(Rect(r.x0 + dx, r.y0 + dy, r.x0 + ex, r.y0 + ey), c))
-						return;
-				}
-			}
+		// 1) First pass - use very coarse resolution rendering, tracing a single ray for a 16x16 block.
+		// The cost of each block is recorded, and then used to make buckets of about equal cost:
+		const int B = PREPASS_BLOCK_SIZE;
+		int blocksPerRow = (frameWidth() + B - 1) / B;
+		vector<BlockCost> costs(blocksPerRow * ((frameHeight() + B - 1) / B));
+		PrepassTask prepass(buckets, costs, blocksPerRow);
+		double prepassStart = getPreciseTime();
+		pool.run(&prepass, scene.settings.numThreads);
+		double prepassTime = getPreciseTime() - prepassStart;
+		if (prepass.wasAborted()) return;
+		buckets = getBucketsList(&costs);
+		costOrdered = true;
+		int totalRays = 0, maxDepth = 0, minSize = INT_MAX, maxSize = 0;
+		for (auto& cost: costs) {
+			totalRays += cost.rays;
+			maxDepth = max(maxDepth, cost.maxDepth);
 		}
+		for (auto& r: buckets) {
+			minSize = min(minSize, max(r.w, r.h));
+			maxSize = max(maxSize, max(r.w, r.h));
+		}
+		printf("Prepass: %.2lfs, %d rays, max depth %d; %d buckets of %d to %d pixels\n", prepassTime, totalRays,
+			maxDepth, int(buckets.size()), minSize, maxSize);
 	}
 
-	MainRenderTask mtrend(buckets);
+	if (scene.settings.progressive && !scene.settings.interactive) {
+		renderProgressive(buckets, costOrdered);
+		return;
+	}
+	
+	MainRenderTask mtrend(buckets, costOrdered);
 	pool.run(&mtrend, scene.settings.numThreads);
+	if (!scene.settings.interactive) mtrend.printStats();
 	
 	if (scene.settings.needAApass()) {
 		// the previous render was without any anti-aliasing whatsoever, and the 
 		// scene file specifies that AA is desired. Detect edges here, and refine in another pass:
 		detectAApixels(buckets);
 		
-		RefineRenderTask refineTask(buckets);
+		RefineRenderTask refineTask(buckets, costOrdered);
 		pool.run(&refineTask, scene.settings.numThreads);
 	}
 }
@@ -493,8 +713,86 @@ void mainloop(void)
 
 const char* DEFAULT_SCENE = "data/smallpt.qdmg";
 
+/**
+ * Renders a scene without a window, and saves the result (batch mode):
+ *   quaddamage --batch scene.qdmg output.exr [--size WIDTHxHEIGHT] [--threads N]
+ * The format of the output (EXR or BMP) is taken from its extension.
+ */
+static int renderBatch(int argc, char** argv)
+{
+	const char* sceneFile = argv[2];
+	const char* outputFile = argv[3];
+	int width = 0, height = 0, threads = -1;
+	for (int i = 4; i < argc; i++) {
+		if (!strcmp(argv[i], "--size") && i + 1 < argc && 2 == sscanf(argv[i + 1], "%dx%d", &width, &height)) i++;
+		else if (!strcmp(argv[i], "--threads") && i + 1 < argc && 1 == sscanf(argv[i + 1], "%d", &threads)) i++;
+		else {
+			printf("Unknown option `%s'\n", argv[i]);
+			return -1;
+		}
+	}
+	if (extensionUpper(outputFile) != "EXR" && extensionUpper(outputFile) != "BMP") {
+		printf("The output file must be .exr or .bmp\n");
+		return -1;
+	}
+	initRandom(42);
+	Color::init_sRGB_cache();
+	if (!scene.parseScene(sceneFile)) {
+		printf("Could not parse the scene!\n");
+		return -1;
+	}
+	GlobalSettings& settings = scene.settings;
+	if (width > 0 && height > 0) {
+		// keep the pixels square, if the aspect ratio of the frame changes:
+		scene.camera->aspectRatio *= (double(width) / height) / (double(settings.frameWidth) / settings.frameHeight);
+		settings.frameWidth = width;
+		settings.frameHeight = height;
+	}
+	if (threads >= 0) settings.numThreads = threads;
+	if (settings.numThreads == 0) settings.numThreads = get_processor_count();
+	settings.interactive = false;
+	
+	if (!initHeadless(settings.frameWidth, settings.frameHeight)) return -1;
+	vfb.init(frameWidth(), frameHeight());
+	needsAA.init(frameWidth(), frameHeight());
+	pool.preload_threads(settings.numThreads);
+	scene.beginRender();
+	
+	double startTime = getPreciseTime();
+	render();
+	printf("Render took %.2fs\n", getPreciseTime() - startTime);
+	bool saved = takeScreenshot(outputFile);
+	closeGraphics();
+	return saved ? 0 : -1;
+}
+
 int main ( int argc, char** argv )
 {
+	if ((argc == 4 || argc == 5) && !strcmp(argv[1], "--convert") && extensionUpper(argv[3]) == "QDHF") {
+		// convert a heightmap image to a tiled heightfield file (.qdhf), optionally blurring it:
+		double blur = argc == 5 ? atof(argv[4]) : 0;
+		if (!Heightfield::convertToTiled(argv[2], blur, argv[3])) {
+			printf("Could not convert %s to %s!\n", argv[2], argv[3]);
+			return -1;
+		}
+		printf("Converted %s to %s\n", argv[2], argv[3]);
+		return 0;
+	}
+	if (argc == 4 && !strcmp(argv[1], "--convert")) {
+		// convert an OBJ file to a binary mesh file (.qdmesh), which loads much faster:
+		Mesh mesh;
+		if (!mesh.loadFromOBJ(argv[2])) {
+			printf("Could not parse %s!\n", argv[2]);
+			return -1;
+		}
+		if (!mesh.saveBinaryMesh(argv[3])) {
+			printf("Could not write %s!\n", argv[3]);
+			return -1;
+		}
+		printf("Converted %s to %s\n", argv[2], argv[3]);
+		return 0;
+	}
+	if (argc >= 4 && !strcmp(argv[1], "--batch")) return renderBatch(argc, argv);
 	initRandom(42);
 	Color::init_sRGB_cache();
 	const char* sceneFile = argc == 2 ? argv[1] : DEFAULT_SCENE;
@@ -505,6 +803,8 @@ int main ( int argc, char** argv )
 	
 	initGraphics(scene.settings.frameWidth, scene.settings.frameHeight,
 		scene.settings.interactive && scene.settings.fullscreen);
+	vfb.init(frameWidth(), frameHeight());
+	needsAA.init(frameWidth(), frameHeight());
 	setWindowCaption("Quad Damage: preparing...");
 	
 	if (scene.settings.numThreads == 0)
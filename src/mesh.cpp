@@ -30,62 +30,422 @@
 #include "mesh.h"
 #include "constants.h"
 #include "color.h"
+#include "scene.h"
+#include "cxxptl_sdl.h"
+#include "objloader.h"
 using std::max;
 using std::vector;
 using std::string;
 
+extern ThreadPool pool; // from main.cpp
+
+/// Builds a list of deferred KD subtrees on all threads. Each subtree is built
+/// exactly as it would be by a serial Mesh::buildKD(), so the resulting tree is the same.
+class ParallelKDBuilder: public Parallel {
+	Mesh& mesh;
+	std::vector<KDBuildTask>& tasks;
+	InterlockedInt counter;
+public:
+	ParallelKDBuilder(Mesh& mesh, std::vector<KDBuildTask>& tasks): mesh(mesh), tasks(tasks), counter(0) {}
+	void entry(int threadIdx, int threadCount)
+	{
+		int i;
+		while ((i = counter++) < int(tasks.size())) {
+			KDBuildTask& task = tasks[i];
+			task.subtree.nodes.resize(1);
+			mesh.buildKD(task.subtree, 0, task.bbox, task.triangles, task.depth);
+			// free the memory early, the list isn't needed anymore:
+			std::vector<int>().swap(task.triangles);
+		}
+	}
+};
+
 
 void Mesh::beginRender()
 {
 	computeBoundingGeometry();
-	kdroot = NULL;
-	printf("Mesh loaded, %d triangles\n", int(triangles.size()));
-	maxDepthSum = 0;
-	numNodes = 0;
-	if (triangles.size() > 50 && useKDTree) {
-		Uint32 startBuild = SDL_GetTicks();
-		kdroot = new KDTreeNode;
-		vector<int> triangleList(triangles.size());
-		std::iota(triangleList.begin(), triangleList.end(), 0);
-		buildKD(kdroot, bbox, triangleList, 0);
-		Uint32 endBuild = SDL_GetTicks();
-		printf(" -> KDTree built in %.2lfs, avg depth = %.1lf\n", (endBuild - startBuild) / 1000.0, maxDepthSum / double(numNodes));
+	printf("Mesh loaded, %d triangles (%.1lf MB)\n", int(triangles.size()),
+		triangles.size() * (sizeof(Triangle) + sizeof(FloatTriangle)) / 1048576.0);
+	if (!useKDCache || !loadKDCache()) {
+		buildKDTree();
+		if (useKDCache) saveKDCache();
 	}
 	
 	if (normals.size() <= 1 && autoSmooth) {
-		normals.resize(vertices.size(), Vector(0, 0, 0)); // extend the normals[] array, and fill with zeros
-		for (int i = 0; i < (int) triangles.size(); i++)
+		// (if the mesh data is mapped from a file, the modified arrays are copies)
+		vector<Vector> newNormals(vertices.size(), Vector(0, 0, 0));
+		vector<Triangle> newTriangles = triangles.copy();
+		for (int i = 0; i < (int) newTriangles.size(); i++)
 			for (int j = 0; j < 3; j++) {
-				triangles[i].n[j] = triangles[i].v[j];
-				normals[triangles[i].n[j]] += triangles[i].gnormal;
+				newTriangles[i].n[j] = newTriangles[i].v[j];
+				newNormals[newTriangles[i].n[j]] += faceNormal(newTriangles[i]);
 			}
-		for (int i = 1; i < (int) normals.size(); i++)
-			if (normals[i].lengthSqr() > 1e-9) normals[i].normalize();
+		for (int i = 1; i < (int) newNormals.size(); i++)
+			if (newNormals[i].lengthSqr() > 1e-9) newNormals[i].normalize();
+		normals.setOwned(newNormals);
+		triangles.setOwned(newTriangles);
 	}
 	// if the object is set to be smooth-shaded, but it lacks normals, we have to revert it to "faceted":
 	if (normals.size() <= 1) faceted = true;
 }
 
-void Mesh::buildKD(KDTreeNode* node, BBox bbox, const vector<int>& triangleList, int depth)
+bool Mesh::bakeTransform(const Transform& transform)
+{
+	if (useKDCache) return false;
+	vector<Vector> newVertices = vertices.copy();
+	for (auto& v: newVertices) v = transform.point(v);
+	vertices.setOwned(newVertices);
+	vector<Vector> newNormals = normals.copy();
+	for (auto& n: newNormals) {
+		n = transform.normal(n);
+		if (n.lengthSqr() > 1e-9) n.normalize();
+	}
+	normals.setOwned(newNormals);
+	if (transform.flipsOrientation()) {
+		// a mirroring transform reverses the winding, so restore it (the face normals and culling depend on it):
+		vector<Triangle> newTriangles = triangles.copy();
+		for (auto& t: newTriangles) {
+			std::swap(t.v[1], t.v[2]);
+			std::swap(t.n[1], t.n[2]);
+			std::swap(t.t[1], t.t[2]);
+		}
+		triangles.setOwned(newTriangles);
+	}
+	if (meshFile.isOpen()) {
+		// the precomputed data from the binary mesh file is in object space:
+		vector<FloatTriangle> data;
+		computeFloatTriangles(data, floatOrigin);
+		floatTriangles.setOwned(data);
+	}
+	return true;
+}
+
+void Mesh::buildKDTree()
 {
-	if (depth > MAX_TREE_DEPTH || int(triangleList.size()) < TRIANGLES_PER_LEAF) {
-		maxDepthSum += depth;
-		numNodes++;
-		node->initLeaf(triangleList);
+	kdCache.close();
+	// binary mesh files have these precomputed:
+	if (!meshFile.isOpen()) {
+		vector<FloatTriangle> data;
+		computeFloatTriangles(data, floatOrigin);
+		floatTriangles.setOwned(data);
+	}
+	kdtree.clear();
+	kdtree.nodes.resize(1);
+	vector<int> triangleList(triangles.size());
+	std::iota(triangleList.begin(), triangleList.end(), 0);
+	if (triangles.size() > 50 && useKDTree) {
+		Uint32 startBuild = SDL_GetTicks();
+		// the SAH builder stops splitting based on cost; the depth limit is just a safeguard,
+		// which grows with the mesh size (a good rule of thumb from PBRT):
+		maxTreeDepth = useSAH ? nearestInt(8 + 1.3f * log(double(triangles.size())) / log(2.0)) : MAX_TREE_DEPTH;
+		int numThreads = max(1, scene.settings.numThreads);
+		if (numThreads == 1) {
+			buildKD(kdtree, 0, bbox, triangleList, 0);
+		} else {
+			// build the top of the tree serially, until there are about 8 subtrees per thread.
+			// These are then built in parallel, the largest ones first:
+			parallelBuildDepth = nearestInt(float(log(8.0 * numThreads) / log(2.0)));
+			vector<KDBuildTask> tasks;
+			buildKD(kdtree, 0, bbox, triangleList, 0, &tasks);
+			std::stable_sort(tasks.begin(), tasks.end(), [] (const KDBuildTask& a, const KDBuildTask& b) {
+				return a.triangles.size() > b.triangles.size();
+			});
+			ParallelKDBuilder builder(*this, tasks);
+			pool.run(&builder, numThreads);
+			for (auto& task: tasks)
+				kdtree.graft(task.node, task.subtree);
+		}
+		Uint32 endBuild = SDL_GetTicks();
+		kdNodes = kdtree.nodes.data();
+		KDTreeStats stats;
+		collectKDStats(0, bbox, 0, stats);
+		printf(" -> KDTree (%s) built in %.2lfs on %d thread(s), avg depth = %.1lf\n", useSAH ? "SAH" : "midpoint",
+			(endBuild - startBuild) / 1000.0, numThreads, stats.leafDepthSum / double(stats.leaves));
+		printf(" -> SAH cost = %.2lf, %d inner nodes, %d leaves (%d empty), %.1lf triangles/leaf, max depth = %d\n",
+			stats.sahCost(), stats.innerNodes, stats.leaves, stats.emptyLeaves,
+			stats.leafTriangles / double(max(1, stats.leaves - stats.emptyLeaves)), stats.maxDepth);
+		printf(" -> expected per ray: %.1lf traversal steps, %.1lf triangle tests; tree size = %.1lf MB\n",
+			stats.expectedTraversals, stats.expectedIntersections, kdtree.memoryUsage() / 1048576.0);
+	} else {
+		// small meshes (or ones with useKDTree=false) are tested linearly: the whole mesh is a single leaf
+		kdtree.nodes[0].initLeaf(0, int(triangles.size()));
+		kdtree.triangles = triangleList;
+	}
+	kdNodes = kdtree.nodes.data();
+	kdTriangles = kdtree.triangles.data();
+}
+
+void Mesh::computeFloatTriangles(vector<FloatTriangle>& result, Vector& origin) const
+{
+	// a mesh far from the world origin would lose most of the float precision of its vertex coordinates:
+	BBox box;
+	box.makeEmpty();
+	for (auto& v: vertices) box.add(v);
+	origin = vertices.size() ? (box.vmin + box.vmax) * 0.5 : Vector(0, 0, 0);
+	result.resize(triangles.size());
+	for (int i = 0; i < (int) triangles.size(); i++) {
+		const Triangle& T = triangles[i];
+		result[i].set(vertices[T.v[0]], vertices[T.v[1]], vertices[T.v[2]], origin);
+	}
+}
+
+/// The header of a KD tree cache file. It is followed by the tree nodes, the FloatTriangles and the leaves'
+/// triangle indices (the file is mapped in memory and used in place, so the sections are 8-byte aligned).
+struct KDCacheHeader {
+	char magic[8];
+	int version;
+	int useKDTree, useSAH;
+	int numVertices, numTriangles;
+	int numNodes, numTriangleRefs;
+	int reserved;
+	double floatOrigin[3]; //!< the FloatTriangles are relative to that point
+	// the cache is valid only for this exact OBJ file:
+	long long objSize, objModTime;
+	char objFile[256];
+};
+
+static const char KD_CACHE_MAGIC[8] = { 'Q', 'D', 'K', 'D', 'T', 'R', 'E', 'E' };
+static const int KD_CACHE_VERSION = 3; // increase this on any change in the file format or the tree builder
+
+/// the header for the current mesh, or false if it can't be used with a cache file
+static bool fillKDCacheHeader(KDCacheHeader& header, const string& objFile, bool useKDTree, bool useSAH,
+                              int numVertices, int numTriangles)
+{
+	memset(&header, 0, sizeof(header));
+	if (objFile.length() >= sizeof(header.objFile)) return false;
+	if (!getFileStamp(objFile.c_str(), header.objSize, header.objModTime)) return false;
+	memcpy(header.magic, KD_CACHE_MAGIC, sizeof(header.magic));
+	header.version = KD_CACHE_VERSION;
+	header.useKDTree = useKDTree;
+	header.useSAH = useSAH;
+	header.numVertices = numVertices;
+	header.numTriangles = numTriangles;
+	strcpy(header.objFile, objFile.c_str());
+	return true;
+}
+
+/**
+ * checks that a KD tree, loaded from a cache file, is safe to traverse: the children and the leaves'
+ * triangle ranges are inside the arrays, the triangle references are valid, and the tree isn't deeper than
+ * the traversal stacks allow. The builder always puts the children after their parent, so one pass suffices.
+ */
+static bool checkKDTree(const KDTreeNode* nodes, int numNodes, const int* refs, int numRefs, int numTriangles)
+{
+	if (numNodes < 1) return false;
+	vector<unsigned char> depth(numNodes, 0);
+	for (int i = 0; i < numNodes; i++) {
+		const KDTreeNode& node = nodes[i];
+		if (node.isLeaf()) {
+			if ((long long) node.firstTriangle + node.getNumTriangles() > numRefs) return false;
+		} else {
+			int children = node.getChildren();
+			if (children <= i || children + 1 >= numNodes || depth[i] > MAX_TREE_DEPTH) return false;
+			depth[children] = max(depth[children], (unsigned char) (depth[i] + 1));
+			depth[children + 1] = max(depth[children + 1], (unsigned char) (depth[i] + 1));
+		}
+	}
+	for (int i = 0; i < numRefs; i++)
+		if (unsigned(refs[i]) >= unsigned(numTriangles)) return false;
+	return true;
+}
+
+string Mesh::kdCacheFileName() const
+{
+	return fileName + ".kdcache";
+}
+
+bool Mesh::loadKDCache()
+{
+	Uint32 startLoad = SDL_GetTicks();
+	KDCacheHeader expected;
+	if (!fillKDCacheHeader(expected, fileName, useKDTree, useSAH, int(vertices.size()), int(triangles.size())))
+		return false;
+	string cacheFile = kdCacheFileName();
+	if (!kdCache.open(cacheFile.c_str())) return false;
+	if (kdCache.size() < sizeof(KDCacheHeader)) {
+		printf(" -> KDTree cache %s is outdated, rebuilding\n", cacheFile.c_str());
+		kdCache.close();
+		return false;
+	}
+	
+	const KDCacheHeader* header = (const KDCacheHeader*) kdCache.data();
+	// compare everything, except the tree sizes, which aren't known yet:
+	expected.numNodes = max(0, header->numNodes);
+	expected.numTriangleRefs = max(0, header->numTriangleRefs);
+	memcpy(expected.floatOrigin, header->floatOrigin, sizeof(expected.floatOrigin));
+	size_t nodesSize = size_t(expected.numNodes) * sizeof(KDTreeNode);
+	size_t floatTrisSize = size_t(expected.numTriangles) * sizeof(FloatTriangle);
+	size_t refsSize = size_t(expected.numTriangleRefs) * sizeof(int);
+	const char* data = (const char*) kdCache.data() + sizeof(KDCacheHeader);
+	// (a negative count differs from the clamped one in `expected', so it fails the header comparison)
+	if (memcmp(header, &expected, sizeof(KDCacheHeader)) ||
+	    kdCache.size() != sizeof(KDCacheHeader) + nodesSize + floatTrisSize + refsSize ||
+	    !checkKDTree((const KDTreeNode*) data, expected.numNodes, (const int*) (data + nodesSize + floatTrisSize),
+	                 expected.numTriangleRefs, expected.numTriangles)) {
+		printf(" -> KDTree cache %s is outdated, rebuilding\n", cacheFile.c_str());
+		kdCache.close();
+		return false;
+	}
+	
+	kdtree.clear();
+	kdNodes = (const KDTreeNode*) data;
+	if (!meshFile.isOpen()) { // (binary mesh files have these already)
+		floatTriangles.setExternal((const FloatTriangle*) (data + nodesSize), triangles.size());
+		floatOrigin = Vector(header->floatOrigin[0], header->floatOrigin[1], header->floatOrigin[2]);
+	}
+	kdTriangles = (const int*) (data + nodesSize + floatTrisSize);
+	printf(" -> KDTree loaded from %s in %.2lfs, %d nodes, tree size = %.1lf MB\n", cacheFile.c_str(),
+		(SDL_GetTicks() - startLoad) / 1000.0, expected.numNodes, (nodesSize + refsSize) / 1048576.0);
+	return true;
+}
+
+void Mesh::saveKDCache()
+{
+	KDCacheHeader header;
+	if (!fillKDCacheHeader(header, fileName, useKDTree, useSAH, int(vertices.size()), int(triangles.size())))
 		return;
+	header.numNodes = int(kdtree.nodes.size());
+	header.numTriangleRefs = int(kdtree.triangles.size());
+	for (int i = 0; i < 3; i++) header.floatOrigin[i] = floatOrigin[i];
+	
+	// write to a temporary file first, so that a concurrent (or interrupted) run never sees a partial cache:
+	string cacheFile = kdCacheFileName();
+	string tempFile = cacheFile + ".tmp";
+	FILE* f = fopen(tempFile.c_str(), "wb");
+	if (!f) {
+		printf(" -> Cannot write KDTree cache %s\n", cacheFile.c_str());
+		return;
+	}
+	bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+	ok = ok && fwrite(kdtree.nodes.data(), sizeof(KDTreeNode), kdtree.nodes.size(), f) == kdtree.nodes.size();
+	ok = ok && fwrite(floatTriangles.data(), sizeof(FloatTriangle), floatTriangles.size(), f) == floatTriangles.size();
+	ok = ok && fwrite(kdtree.triangles.data(), sizeof(int), kdtree.triangles.size(), f) == kdtree.triangles.size();
+	ok = (fclose(f) == 0) && ok;
+	remove(cacheFile.c_str());
+	if (!ok || rename(tempFile.c_str(), cacheFile.c_str()) != 0) {
+		printf(" -> Cannot write KDTree cache %s\n", cacheFile.c_str());
+		remove(tempFile.c_str());
 	}
-	Axis axis = (Axis) (depth % 3); // TODO: could be better
-	double leftLimit = bbox.vmin[axis];
-	double rightLimit = bbox.vmax[axis];
+}
+
+/**
+ * Finds the best splitting plane for a KD tree node, using the surface area heuristic.
+ *
+ * For each axis, the (clipped to the node) extents of all triangles are sorted, and all
+ * triangle boundaries are considered as candidate planes. The cost of a candidate is
+ *
+ *   C = Ct + Ci * (SA(left) * Nleft + SA(right) * Nright) / SA(node)
+ *
+ * (Ct = traversal cost, Ci = intersection cost, SA = surface area). If the best candidate is
+ * not cheaper than just testing all triangles (Ci * N), no split is done and false is returned.
+ */
+bool Mesh::findSAHSplit(const BBox& bbox, const vector<int>& triangleList, Axis& axis, double& splitPos)
+{
+	int n = int(triangleList.size());
+	double bestCost = SAH_INTERSECTION_COST * n; // the cost of making this node a leaf
+	double rArea = 1.0 / bbox.area();
+	bool found = false;
+	vector<double> starts(n), ends(n);
 	
-	double optimalSplitPos = (leftLimit + rightLimit) * 0.5; // TODO: could be MUCH better!
+	for (int dim = 0; dim < 3; dim++) {
+		if (bbox.vmax[dim] - bbox.vmin[dim] < 1e-9) continue;
+		for (int i = 0; i < n; i++) {
+			const Triangle& T = triangles[triangleList[i]];
+			double a = vertices[T.v[0]][dim], b = vertices[T.v[1]][dim], c = vertices[T.v[2]][dim];
+			starts[i] = max(bbox.vmin[dim], min(a, min(b, c)));
+			ends[i]   = min(bbox.vmax[dim], max(a, max(b, c)));
+		}
+		std::sort(starts.begin(), starts.end());
+		std::sort(ends.begin(), ends.end());
+		// sweep all triangle boundaries in increasing order. At each candidate position p,
+		// `i' triangles start before p, and `j' triangles end before (or at) p:
+		int i = 0, j = 0;
+		while (i < n || j < n) {
+			double p = min(i < n ? starts[i] : INF, j < n ? ends[j] : INF);
+			int endingHere = 0;
+			while (j + endingHere < n && ends[j + endingHere] == p) endingHere++;
+			// split positions are stored as floats in the tree; consider only the rounded position, otherwise
+			// we'd get slivers between a triangle's boundary and the (rounded) parent's boundary:
+			double pf = float(p);
+			
+			if (bbox.vmin[dim] < pf && pf < bbox.vmax[dim]) {
+				BBox left, right;
+				bbox.split((Axis) dim, pf, left, right);
+				int nLeft = i;
+				int nRight = n - j - endingHere;
+				double cost = SAH_TRAVERSAL_COST +
+					SAH_INTERSECTION_COST * (left.area() * nLeft + right.area() * nRight) * rArea;
+				if (nLeft == 0 || nRight == 0) cost *= 1 - SAH_EMPTY_BONUS;
+				if (cost < bestCost) {
+					bestCost = cost;
+					axis = (Axis) dim;
+					splitPos = pf;
+					found = true;
+				}
+			}
+			
+			while (i < n && starts[i] == p) i++;
+			j += endingHere;
+		}
+	}
+	return found;
+}
+
+void KDTree::graft(int where, const KDTree& subtree)
+{
+	// subtree.nodes[0] goes to nodes[where], the rest of the subtree nodes are appended,
+	// so node #i (i > 0) of the subtree will be at nodes[base + i]:
+	int base = int(nodes.size()) - 1;
+	unsigned triBase = unsigned(triangles.size());
+	for (int i = 0; i < int(subtree.nodes.size()); i++) {
+		KDTreeNode node = subtree.nodes[i];
+		if (node.isLeaf())
+			node.initLeaf(node.firstTriangle + triBase, node.getNumTriangles());
+		else
+			node.initTreeNode(node.getAxis(), node.splitPos, node.getChildren() + base);
+		if (i == 0)
+			nodes[where] = node;
+		else
+			nodes.push_back(node);
+	}
+	triangles.insert(triangles.end(), subtree.triangles.begin(), subtree.triangles.end());
+}
+
+void Mesh::buildKD(KDTree& tree, int node, BBox bbox, const vector<int>& triangleList, int depth,
+                   vector<KDBuildTask>* deferred)
+{
+	if (deferred && depth == parallelBuildDepth) {
+		deferred->push_back(KDBuildTask { node, bbox, triangleList, depth, KDTree() });
+		return;
+	}
+	Axis axis;
+	double optimalSplitPos;
+	bool makeLeaf;
+	if (useSAH) {
+		makeLeaf = depth > maxTreeDepth || !findSAHSplit(bbox, triangleList, axis, optimalSplitPos);
+	} else {
+		makeLeaf = depth > maxTreeDepth || int(triangleList.size()) < TRIANGLES_PER_LEAF;
+		axis = (Axis) (depth % 3);
+		optimalSplitPos = (bbox.vmin[axis] + bbox.vmax[axis]) * 0.5;
+	}
+	if (!makeLeaf) {
+		// the split position is stored as a float, so use exactly that value for the child boxes:
+		optimalSplitPos = float(optimalSplitPos);
+		if (!(bbox.vmin[axis] < optimalSplitPos && optimalSplitPos < bbox.vmax[axis]))
+			makeLeaf = true;
+	}
+	if (makeLeaf) {
+		tree.nodes[node].initLeaf(int(tree.triangles.size()), int(triangleList.size()));
+		tree.triangles.insert(tree.triangles.end(), triangleList.begin(), triangleList.end());
+		return;
+	}
 	
 	BBox bboxLeft, bboxRight;
 	vector<int> trianglesLeft, trianglesRight;
 	
 	bbox.split(axis, optimalSplitPos, bboxLeft, bboxRight);
 	for (auto triangleIdx: triangleList) {
-		Triangle& T = this->triangles[triangleIdx];
+		const Triangle& T = this->triangles[triangleIdx];
 		const Vector& A = this->vertices[T.v[0]];
 		const Vector& B = this->vertices[T.v[1]];
 		const Vector& C = this->vertices[T.v[2]];
@@ -96,9 +456,39 @@ void Mesh::buildKD(KDTreeNode* node, BBox bbox, const vector<int>& triangleList,
 		if (bboxRight.intersectTriangle(A, B, C))
 			trianglesRight.push_back(triangleIdx);
 	}
-	node->initTreeNode(axis, optimalSplitPos);
-	buildKD(&node->children[0],  bboxLeft,  trianglesLeft, depth + 1);
-	buildKD(&node->children[1], bboxRight, trianglesRight, depth + 1);
+	int children = int(tree.nodes.size());
+	tree.nodes.resize(children + 2);
+	tree.nodes[node].initTreeNode(axis, float(optimalSplitPos), children);
+	buildKD(tree, children,      bboxLeft,  trianglesLeft, depth + 1, deferred);
+	buildKD(tree, children + 1, bboxRight, trianglesRight, depth + 1, deferred);
+}
+
+double KDTreeStats::sahCost() const
+{
+	return SAH_TRAVERSAL_COST * expectedTraversals + SAH_INTERSECTION_COST * expectedIntersections;
+}
+
+void Mesh::collectKDStats(int nodeIdx, const BBox& bbox, int depth, KDTreeStats& stats)
+{
+	// the probability that a ray, hitting the root, also hits this node, is proportional to the areas:
+	double prob = bbox.area() / this->bbox.area();
+	const KDTreeNode& node = kdNodes[nodeIdx];
+	stats.maxDepth = max(stats.maxDepth, depth);
+	if (node.isLeaf()) {
+		int n = node.getNumTriangles();
+		stats.leaves++;
+		if (n == 0) stats.emptyLeaves++;
+		stats.leafTriangles += n;
+		stats.leafDepthSum += depth;
+		stats.expectedIntersections += n * prob;
+	} else {
+		stats.innerNodes++;
+		stats.expectedTraversals += prob;
+		BBox left, right;
+		bbox.split(node.getAxis(), node.splitPos, left, right);
+		collectKDStats(node.getChildren(),     left, depth + 1, stats);
+		collectKDStats(node.getChildren() + 1, right, depth + 1, stats);
+	}
 }
 
 void Mesh::computeBoundingGeometry()
@@ -110,11 +500,6 @@ void Mesh::computeBoundingGeometry()
 	}
 }
 
-Mesh::~Mesh()
-{
-	if (kdroot) delete kdroot;
-}
-
 inline double det(const Vector& a, const Vector& b, const Vector& c)
 {
 	return (a^b) * c;
@@ -162,31 +547,150 @@ bool intersectTriangleFast(const Ray& ray, const Vector& A, const Vector& B, con
 	return true;
 }
 
-bool Mesh::intersectTriangle(const RRay& ray, const Triangle& t, IntersectionInfo& info)
+static void solve2D(Vector A, Vector B, Vector C, double& x, double& y)
+{
+	// solve: x * A + y * B = C
+	double mat[2][2] = { { A.x, B.x }, { A.y, B.y } };
+	double h[2] = { C.x, C.y };
+	
+	double Dcr = mat[0][0] * mat[1][1] - mat[1][0] * mat[0][1];
+	x =         (     h[0] * mat[1][1] -      h[1] * mat[0][1]) / Dcr;
+	y =         (mat[0][0] *      h[1] - mat[1][0] *      h[0]) / Dcr;
+}
+
+/// the geometric normal of a triangle (AB ^ AC, normalized)
+inline Vector Mesh::faceNormal(const Triangle& t) const
+{
+	const Vector& A = vertices[t.v[0]];
+	Vector N = (vertices[t.v[1]] - A) ^ (vertices[t.v[2]] - A);
+	N.normalize();
+	return N;
+}
+
+/**
+ * Tests a ray against (up to) four triangles at once, in single precision.
+ *
+ * This is only a conservative filter: the returned mask has all triangles, which may be hit closer than
+ * maxDist, and the candidates are then confirmed with the exact test (hitTriangle()). So the limits are
+ * relaxed a bit, and triangles, which are nearly parallel to the ray, are always passed on.
+ *
+ * The rounding errors of H = start - A are about an ulp of the coordinates (|start| + |A|); these get scaled
+ * by 1 / Dcr, which is large for small triangles. So besides the fixed tolerance, each limit is widened by
+ * a bound of the rounding error of the respective value, which keeps the filter conservative for small
+ * triangles, far from the float origin.
+ */
+inline int Mesh::filterTriangles(const FloatRay& ray, const int* triIdx, int count, double maxDist)
+{
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 signMask = _mm_set1_ps(-0.0f);
+	const __m128 eps = _mm_set1_ps(1e-3f);
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 ulps = _mm_set1_ps(32.0f / 16777216.0f); // a generous bound of the error terms (in units of 2^-24)
+	
+	// gather the triangles (the unused lanes just repeat the first one) and transpose them to SoA form:
+	const float* tri[4];
+	for (int i = 0; i < 4; i++) tri[i] = floatTriangles[triIdx[i < count ? i : 0]].data;
+	__m128 Ax = _mm_loadu_ps(tri[0]), Ay = _mm_loadu_ps(tri[1]), Az = _mm_loadu_ps(tri[2]), ABx = _mm_loadu_ps(tri[3]);
+	__m128 ABy = _mm_loadu_ps(tri[0] + 4), ABz = _mm_loadu_ps(tri[1] + 4);
+	__m128 ACx = _mm_loadu_ps(tri[2] + 4), ACy = _mm_loadu_ps(tri[3] + 4);
+	_MM_TRANSPOSE4_PS(Ax, Ay, Az, ABx);
+	_MM_TRANSPOSE4_PS(ABy, ABz, ACx, ACy);
+	__m128 ACz = _mm_setr_ps(tri[0][8], tri[1][8], tri[2][8], tri[3][8]);
+	__m128 Hx = _mm_sub_ps(ray.start[0], Ax);
+	__m128 Hy = _mm_sub_ps(ray.start[1], Ay);
+	__m128 Hz = _mm_sub_ps(ray.start[2], Az);
+	__m128 Dx = ray.dir[0], Dy = ray.dir[1], Dz = ray.dir[2];
+	// N = AB ^ AC:
+	__m128 Nx = _mm_sub_ps(_mm_mul_ps(ABy, ACz), _mm_mul_ps(ABz, ACy));
+	__m128 Ny = _mm_sub_ps(_mm_mul_ps(ABz, ACx), _mm_mul_ps(ABx, ACz));
+	__m128 Nz = _mm_sub_ps(_mm_mul_ps(ABx, ACy), _mm_mul_ps(ABy, ACx));
+	
+	__m128 Dcr = _mm_xor_ps(signMask, _mm_add_ps(_mm_add_ps(_mm_mul_ps(Nx, Dx), _mm_mul_ps(Ny, Dy)), _mm_mul_ps(Nz, Dz)));
+	// the scale of Dcr, if the ray is perpendicular to the triangle:
+	__m128 scale = _mm_mul_ps(ray.dirScale, _mm_add_ps(_mm_add_ps(_mm_andnot_ps(signMask, Nx),
+		_mm_andnot_ps(signMask, Ny)), _mm_andnot_ps(signMask, Nz)));
+	__m128 parallel = _mm_cmple_ps(_mm_andnot_ps(signMask, Dcr), _mm_mul_ps(eps, scale));
+	
+	__m128 rDcr = _mm_div_ps(one, Dcr);
+	__m128 gamma = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(Nx, Hx), _mm_mul_ps(Ny, Hy)), _mm_mul_ps(Nz, Hz)), rDcr);
+	// HcrossD = H ^ D:
+	__m128 cx = _mm_sub_ps(_mm_mul_ps(Hy, Dz), _mm_mul_ps(Hz, Dy));
+	__m128 cy = _mm_sub_ps(_mm_mul_ps(Hz, Dx), _mm_mul_ps(Hx, Dz));
+	__m128 cz = _mm_sub_ps(_mm_mul_ps(Hx, Dy), _mm_mul_ps(Hy, Dx));
+	__m128 lambda2 = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(cx, ACx), _mm_mul_ps(cy, ACy)), _mm_mul_ps(cz, ACz)), rDcr);
+	__m128 lambda3 = _mm_mul_ps(_mm_xor_ps(signMask, _mm_add_ps(_mm_add_ps(_mm_mul_ps(ABx, cx), _mm_mul_ps(ABy, cy)),
+		_mm_mul_ps(ABz, cz))), rDcr);
+	
+	// the rounding error bound of H, divided by |Dcr|:
+	__m128 aScale = _mm_add_ps(_mm_add_ps(_mm_andnot_ps(signMask, Ax), _mm_andnot_ps(signMask, Ay)),
+		_mm_andnot_ps(signMask, Az));
+	__m128 errScale = _mm_mul_ps(_mm_mul_ps(ulps, _mm_add_ps(ray.startScale, aScale)), _mm_andnot_ps(signMask, rDcr));
+	// lambda2 = (H ^ D) * AC / Dcr, so its error is about that of H, times |D| * |AC| / |Dcr| (same for lambda3, AB):
+	__m128 acScale = _mm_add_ps(_mm_add_ps(_mm_andnot_ps(signMask, ACx), _mm_andnot_ps(signMask, ACy)),
+		_mm_andnot_ps(signMask, ACz));
+	__m128 abScale = _mm_add_ps(_mm_add_ps(_mm_andnot_ps(signMask, ABx), _mm_andnot_ps(signMask, ABy)),
+		_mm_andnot_ps(signMask, ABz));
+	__m128 lambda2Eps = _mm_add_ps(eps, _mm_mul_ps(_mm_mul_ps(errScale, ray.dirScale), acScale));
+	__m128 lambda3Eps = _mm_add_ps(eps, _mm_mul_ps(_mm_mul_ps(errScale, ray.dirScale), abScale));
+	// the tolerance for gamma is relative to the distance to the triangle (|H| / |D|), and gamma = N * H / Dcr
+	// has the error of H, times |N| / |Dcr|:
+	__m128 hScale = _mm_add_ps(_mm_add_ps(_mm_andnot_ps(signMask, Hx), _mm_andnot_ps(signMask, Hy)),
+		_mm_andnot_ps(signMask, Hz));
+	__m128 nScale = _mm_add_ps(_mm_add_ps(_mm_andnot_ps(signMask, Nx), _mm_andnot_ps(signMask, Ny)),
+		_mm_andnot_ps(signMask, Nz));
+	__m128 gammaEps = _mm_add_ps(_mm_mul_ps(eps, _mm_add_ps(one, _mm_div_ps(hScale, ray.dirScale))),
+		_mm_mul_ps(errScale, nScale));
+	__m128 ok = _mm_and_ps(_mm_cmpge_ps(lambda2, _mm_sub_ps(zero, lambda2Eps)),
+		_mm_cmpge_ps(lambda3, _mm_sub_ps(zero, lambda3Eps)));
+	ok = _mm_and_ps(ok, _mm_cmple_ps(_mm_add_ps(lambda2, lambda3), _mm_add_ps(_mm_add_ps(one, lambda2Eps), lambda3Eps)));
+	ok = _mm_and_ps(ok, _mm_cmpge_ps(gamma, _mm_sub_ps(zero, gammaEps)));
+	ok = _mm_and_ps(ok, _mm_cmple_ps(gamma, _mm_add_ps(_mm_set1_ps(float(min(maxDist, 1e30))), gammaEps)));
+	ok = _mm_or_ps(ok, parallel);
+	if (backfaceCulling) // reject only the triangles, which are clearly facing away:
+		ok = _mm_andnot_ps(_mm_cmplt_ps(Dcr, _mm_sub_ps(zero, _mm_mul_ps(eps, scale))), ok);
+	return _mm_movemask_ps(ok) & ((1 << count) - 1);
+}
+
+/// the exact (double precision) ray-triangle test
+inline bool Mesh::hitTriangle(const RRay& ray, const Triangle& t, double maxDist, double& gamma, double& lambda2, double& lambda3)
 {
-	if (backfaceCulling && dot(ray.dir, t.gnormal) > 0) return false;
 	Vector A = vertices[t.v[0]];
+	Vector AB = vertices[t.v[1]] - A;
+	Vector AC = vertices[t.v[2]] - A;
+	Vector ABcrossAC = AB ^ AC;
+	if (backfaceCulling) {
+		Vector gnormal = ABcrossAC;
+		gnormal.normalize();
+		if (dot(ray.dir, gnormal) > 0) return false;
+	}
 	
 	Vector H = ray.start - A;
 	Vector D = ray.dir;
 	
-	double Dcr = - (t.ABcrossAC * D);
+	double Dcr = - (ABcrossAC * D);
 
 	if (fabs(Dcr) < 1e-12) return false;
 
 	double rDcr = 1 / Dcr;
-	double gamma = (t.ABcrossAC * H) * rDcr;
-	if (gamma < 0 || gamma > info.distance) return false;
+	gamma = (ABcrossAC * H) * rDcr;
+	if (gamma < 0 || gamma > maxDist) return false;
 	
 	Vector HcrossD = H^D;
-	double lambda2 = (HcrossD * t.AC) * rDcr;
+	lambda2 = (HcrossD * AC) * rDcr;
 	if (lambda2 < 0 || lambda2 > 1) return false;
 	
-	double lambda3 = -(t.AB * HcrossD) * rDcr;
+	lambda3 = -(AB * HcrossD) * rDcr;
 	if (lambda3 < 0 || lambda3 > 1) return false;
 	
 	if (lambda2 + lambda3 > 1) return false;
-		
+	
+	return true;
+}
+
+/// fills in the shading data for the closest hit of a ray (which is with triangle `t', at the given distance and coordinates)
+void Mesh::fillIntersection(const Ray& ray, const Triangle& t, double gamma, double lambda2, double lambda3,
+                            IntersectionInfo& info)
+{
 	info.distance = gamma;
 	info.ip = ray.start + ray.dir * gamma;
 	if (!faceted) {
@@ -197,218 +701,482 @@ bool Mesh::intersectTriangle(const RRay& ray, const Triangle& t, IntersectionInf
 		info.normal = nA + (nB - nA) * lambda2 + (nC - nA) * lambda3;
 		info.normal.normalize();
 	} else {
-		info.normal = t.gnormal;
+		info.normal = faceNormal(t);
 	}
 	
-	info.dNdx = t.dNdx;
-	info.dNdy = t.dNdy;
-			
 	Vector uvA = uvs[t.t[0]];
 	Vector uvB = uvs[t.t[1]];
 	Vector uvC = uvs[t.t[2]];
 	
-	Vector uv = uvA + (uvB - uvA) * lambda2 + (uvC - uvA) * lambda3;
+	// (1, 0) = px * texAB + qx * texAC; (1)
+	// (0, 1) = py * texAB + qy * texAC; (2)
+	Vector texAB = uvB - uvA;
+	Vector texAC = uvC - uvA;
+	
+	double px, py, qx, qy;
+	solve2D(texAB, texAC, Vector(1, 0, 0), px, qx); // (1)
+	solve2D(texAB, texAC, Vector(0, 1, 0), py, qy); // (2)
+	
+	Vector A = vertices[t.v[0]];
+	Vector AB = vertices[t.v[1]] - A;
+	Vector AC = vertices[t.v[2]] - A;
+	info.dNdx = px * AB + qx * AC;
+	info.dNdy = py * AB + qy * AC;
+	info.dNdx.normalize();
+	info.dNdy.normalize();
+	
+	Vector uv = uvA + texAB * lambda2 + texAC * lambda3;
 	info.u = uv.x;
 	info.v = uv.y;
 	info.geom = this;
-	
-	return true;
 }
 
-bool Mesh::intersectKD(KDTreeNode* node, const BBox& bbox, const RRay& ray, IntersectionInfo& info)
+bool Mesh::intersectLeaf(const RRay& ray, const FloatRay& floatRay, const KDTreeNode& leaf, double& closestDist,
+                         int& closestTriangle, double& lambda2, double& lambda3)
 {
-	if (node->axis == AXIS_NONE) {
-		bool found = false;
-		for (int& triIdx: (*node->triangles)) {
-			if (intersectTriangle(ray, triangles[triIdx], info))
+	const int* triIdx = kdTriangles + leaf.firstTriangle;
+	bool found = false;
+	for (int n = leaf.getNumTriangles(); n > 0; n -= 4, triIdx += 4) {
+		int candidates = filterTriangles(floatRay, triIdx, min(n, 4), closestDist);
+		// (rarely) some triangles pass the filter; check them exactly, in order:
+		for (int i = 0; candidates; i++, candidates >>= 1) {
+			double gamma, l2, l3;
+			if ((candidates & 1) && hitTriangle(ray, triangles[triIdx[i]], closestDist, gamma, l2, l3)) {
+				closestDist = gamma;
+				closestTriangle = triIdx[i];
+				lambda2 = l2;
+				lambda3 = l3;
 				found = true;
+			}
 		}
-		return (found && bbox.inside(info.ip));
-	} else {
-		BBox childBBox[2];
-		bbox.split(node->axis, node->splitPos, childBBox[0], childBBox[1]);
-		
-		int childOrder[2] = { 0, 1 };
-		if (ray.start[node->axis] > node->splitPos) {
-			std::swap(childOrder[0], childOrder[1]);
-		}
-		
-		BBox& firstBB = childBBox[childOrder[0]];
-		BBox& secondBB = childBBox[childOrder[1]];
-		KDTreeNode& firstChild = node->children[childOrder[0]];
-		KDTreeNode& secondChild = node->children[childOrder[1]];
-		// if the ray intersects the common wall between the two sub-boxes, then it invariably
-		// intersects both boxes (we can skip the testIntersect() checks):
-		// (see http://raytracing-bg.net/?q=node/68 )
-		if (bbox.intersectWall(node->axis, node->splitPos, ray)) {
-			if (intersectKD(&firstChild, firstBB, ray, info)) return true;
-			return intersectKD(&secondChild, secondBB, ray, info);
+	}
+	return found;
+}
+
+/**
+ * Front-to-back KD tree traversal.
+ *
+ * The ray is clipped against the mesh's bbox, and then each node is visited with the [tmin, tmax] interval
+ * of the ray, which lies inside that node. At inner nodes, the distance to the splitting plane determines
+ * if only one child is visited, or both (the far one is pushed on a stack, with the remaining interval).
+ * If a leaf produces a hit, which is no further than the leaf's tmax, it is the closest one and we're done.
+ * Only the hit record is filled; see fillIntersection().
+ */
+bool Mesh::intersectKD(const RRay& ray, double maxDist, HitRecord& hit)
+{
+	FloatRay floatRay(ray, floatOrigin);
+	struct StackEntry {
+		int node;
+		double tmin, tmax;
+	};
+	StackEntry stack[MAX_TREE_DEPTH + 2];
+	int stackSize = 0;
+	
+	double tmin, tmax;
+	if (!bbox.clipRay(ray, tmin, tmax) || tmin >= maxDist) return false;
+	tmax = min(tmax, maxDist);
+	
+	const KDTreeNode* nodes = kdNodes;
+	int nodeIdx = 0;
+	bool found = false;
+	double closestDist = maxDist, lambda2, lambda3;
+	int closestTriangle;
+	while (true) {
+		const KDTreeNode& node = nodes[nodeIdx];
+		if (!node.isLeaf()) {
+			Axis axis = node.getAxis();
+			double splitPos = node.splitPos;
+			double tSplit = (splitPos - ray.start[axis]) * ray.rdir[axis];
+			// which of the children is hit first by the ray?
+			bool belowFirst = ray.start[axis] < splitPos || (ray.start[axis] == splitPos && ray.dir[axis] <= 0);
+			int firstChild = node.getChildren() + (belowFirst ? 0 : 1);
+			int secondChild = node.getChildren() + (belowFirst ? 1 : 0);
+			
+			if (tSplit > tmax || tSplit <= 0) {
+				// the ray doesn't reach the splitting plane within this node:
+				nodeIdx = firstChild;
+			} else if (tSplit < tmin) {
+				// the ray has already crossed the splitting plane before entering this node:
+				nodeIdx = secondChild;
+			} else {
+				stack[stackSize++] = StackEntry { secondChild, tSplit, tmax };
+				nodeIdx = firstChild;
+				tmax = tSplit;
+			}
 		} else {
-			// if the wall isn't hit, then we intersect exclusively one of the sub-boxes;
-			// test one, if the test fails, then it's in the other:
-			if (firstBB.testIntersect(ray))
-				return intersectKD(&firstChild, firstBB, ray, info);
-			else
-				return intersectKD(&secondChild, secondBB, ray, info);
+			if (intersectLeaf(ray, floatRay, node, closestDist, closestTriangle, lambda2, lambda3))
+				found = true;
+			// a hit inside the current interval can't be occluded by anything in the nodes further away:
+			if ((found && closestDist <= tmax + 1e-6) || stackSize == 0) {
+				if (!found || !(closestDist < maxDist)) return false;
+				hit.distance = closestDist;
+				hit.primitive = closestTriangle;
+				hit.b1 = lambda2;
+				hit.b2 = lambda3;
+				return true;
+			}
+			StackEntry& entry = stack[--stackSize];
+			nodeIdx = entry.node;
+			tmin = entry.tmin;
+			tmax = entry.tmax;
 		}
-		return false;
 	}
 }
 
-bool Mesh::intersect(const Ray& _ray, IntersectionInfo& info)
+bool Mesh::intersect(const Ray& ray, IntersectionInfo& info)
+{
+	HitRecord hit;
+	if (!findHit(ray, INF, hit)) return false;
+	computeSurface(ray, hit, info);
+	return true;
+}
+
+bool Mesh::findHit(const Ray& _ray, double maxDist, HitRecord& hit)
 {
 	RRay ray(_ray);
 	ray.prepareForTracing();
-	if (!bbox.testIntersect(ray))
-		return false;
 	
-	if (kdroot) {
-		info.distance = INF;
-		return intersectKD(kdroot, bbox, ray, info);
-	} else {
-		bool found = false;
-		
-		info.distance = INF;
-		
-		for (auto& T: triangles) {
-			if (intersectTriangle(ray, T, info)) {
-				found = true;
+	return intersectKD(ray, maxDist, hit);
+}
+
+void Mesh::computeSurface(const Ray& ray, const HitRecord& hit, IntersectionInfo& info)
+{
+	fillIntersection(ray, triangles[hit.primitive], hit.distance, hit.b1, hit.b2, info);
+}
+
+/**
+ * Packet version of intersectKD(), for coherent packets (see RayPacket::isCoherent()).
+ *
+ * All rays visit the children of a node in the same order, so the whole packet descends the tree together.
+ * Each ray keeps its own [tmin, tmax] interval (in SSE2 registers); a ray, which doesn't need a child,
+ * gets an empty interval there, and rays, which have found their closest hit, are excluded.
+ * Per ray, the visited leaves and the results are the same as with intersectKD().
+ */
+int Mesh::intersectKDPacket(const RayPacket& packet, int mask, const double maxDist[], HitRecord hits[])
+{
+	struct StackEntry {
+		__m128d tmin[2], tmax[2];
+		int node;
+	};
+	StackEntry stack[MAX_TREE_DEPTH + 2];
+	int stackSize = 0;
+	
+	__m128d tmin[2], tmax[2];
+	mask = packet.clipBox(bbox, mask, maxDist, tmin, tmax);
+	if (!mask) return 0;
+	tmax[0] = _mm_min_pd(tmax[0], _mm_loadu_pd(maxDist));
+	tmax[1] = _mm_min_pd(tmax[1], _mm_loadu_pd(maxDist + 2));
+	
+	int firstRay = 0;
+	while (!(mask & (1 << firstRay))) firstRay++;
+	const RRay& leadRay = packet.rays[firstRay];
+	
+	const __m128d zero = _mm_setzero_pd();
+	const __m128d posInf = _mm_set1_pd(INF), negInf = _mm_set1_pd(-INF);
+	FloatRay floatRays[RayPacket::SIZE];
+	double closestDist[RayPacket::SIZE], lambda2[RayPacket::SIZE], lambda3[RayPacket::SIZE];
+	int closestTriangle[RayPacket::SIZE];
+	for (int i = 0; i < RayPacket::SIZE; i++) {
+		if (mask & (1 << i)) floatRays[i] = FloatRay(packet.rays[i], floatOrigin);
+		closestDist[i] = maxDist[i];
+	}
+	
+	const KDTreeNode* nodes = kdNodes;
+	int nodeIdx = 0;
+	int found = 0, done = ~mask;
+	while (true) {
+		const KDTreeNode& node = nodes[nodeIdx];
+		if (!node.isLeaf()) {
+			Axis axis = node.getAxis();
+			double splitPos = node.splitPos;
+			// the rays have a common origin and direction signs, so this is the same for all:
+			bool belowFirst = leadRay.start[axis] < splitPos || (leadRay.start[axis] == splitPos && leadRay.dir[axis] <= 0);
+			int firstChild = node.getChildren() + (belowFirst ? 0 : 1);
+			int secondChild = node.getChildren() + (belowFirst ? 1 : 0);
+			
+			__m128d split = _mm_set1_pd(splitPos);
+			__m128d firstMax[2], secondMin[2];
+			int needFirst = 0, needSecond = 0;
+			for (int k = 0; k < 2; k++) {
+				// the same three cases as in intersectKD(), for each ray:
+				__m128d tSplit = _mm_mul_pd(_mm_sub_pd(split, packet.start[axis][k]), packet.rdir[axis][k]);
+				__m128d valid = _mm_cmple_pd(tmin[k], tmax[k]);
+				__m128d firstOnly = _mm_or_pd(_mm_cmpgt_pd(tSplit, tmax[k]), _mm_cmple_pd(tSplit, zero));
+				__m128d secondOnly = _mm_andnot_pd(firstOnly, _mm_cmplt_pd(tSplit, tmin[k]));
+				__m128d both = _mm_andnot_pd(_mm_or_pd(firstOnly, secondOnly), valid);
+				firstMax[k] = packetSelect(secondOnly, negInf, packetSelect(both, tSplit, tmax[k]));
+				secondMin[k] = packetSelect(firstOnly, posInf, packetSelect(both, tSplit, tmin[k]));
+				needFirst |= _mm_movemask_pd(_mm_andnot_pd(secondOnly, valid)) << (2 * k);
+				needSecond |= _mm_movemask_pd(_mm_andnot_pd(firstOnly, valid)) << (2 * k);
+			}
+			needFirst &= ~done;
+			needSecond &= ~done;
+			
+			if (needFirst && needSecond) {
+				StackEntry& entry = stack[stackSize++];
+				entry.node = secondChild;
+				for (int k = 0; k < 2; k++) {
+					entry.tmin[k] = secondMin[k];
+					entry.tmax[k] = tmax[k];
+					tmax[k] = firstMax[k];
+				}
+				nodeIdx = firstChild;
+				continue;
+			}
+			if (needFirst) {
+				tmax[0] = firstMax[0];
+				tmax[1] = firstMax[1];
+				nodeIdx = firstChild;
+				continue;
+			}
+			if (needSecond) {
+				tmin[0] = secondMin[0];
+				tmin[1] = secondMin[1];
+				nodeIdx = secondChild;
+				continue;
+			}
+		} else {
+			int rays = packetIntervalMask(tmin, tmax) & ~done;
+			if (rays) {
+				double tmaxRay[RayPacket::SIZE];
+				_mm_storeu_pd(tmaxRay, tmax[0]);
+				_mm_storeu_pd(tmaxRay + 2, tmax[1]);
+				for (int i = 0; i < RayPacket::SIZE; i++) {
+					if (!(rays & (1 << i))) continue;
+					if (intersectLeaf(packet.rays[i], floatRays[i], node, closestDist[i], closestTriangle[i],
+					                  lambda2[i], lambda3[i]))
+						found |= 1 << i;
+					if ((found & (1 << i)) && closestDist[i] <= tmaxRay[i] + 1e-6) done |= 1 << i;
+				}
+			}
+		}
+		// pop the next node, which some of the remaining rays still need:
+		while (true) {
+			if (stackSize == 0 || (done & mask) == mask) {
+				for (int i = 0; i < RayPacket::SIZE; i++)
+					if ((found & (1 << i)) && closestDist[i] < maxDist[i]) {
+						hits[i].distance = closestDist[i];
+						hits[i].primitive = closestTriangle[i];
+						hits[i].b1 = lambda2[i];
+						hits[i].b2 = lambda3[i];
+					} else {
+						found &= ~(1 << i);
+					}
+				return found;
+			}
+			StackEntry& entry = stack[--stackSize];
+			if (packetIntervalMask(entry.tmin, entry.tmax) & ~done) {
+				nodeIdx = entry.node;
+				for (int k = 0; k < 2; k++) {
+					tmin[k] = entry.tmin[k];
+					tmax[k] = entry.tmax[k];
+				}
+				break;
 			}
 		}
-		
-		return found;
 	}
 }
 
-static int toInt(const string& s)
+int Mesh::findHitPacket(const RayPacket& packet, int mask, const double maxDist[], HitRecord hits[])
 {
-	if (s.empty()) return 0;
-	int x;
-	if (1 == sscanf(s.c_str(), "%d", &x)) return x;
-	return 0;
+	if (!packet.isCoherent(mask))
+		return Geometry::findHitPacket(packet, mask, maxDist, hits);
+	return intersectKDPacket(packet, mask, maxDist, hits);
 }
 
-static double toDouble(const string& s)
+/// Same as intersectKD(), but stops at the first triangle, which is hit closer than maxDist
+bool Mesh::intersectKDAny(const RRay& ray, double maxDist)
 {
-	if (s.empty()) return 0;
-	double x;
-	if (1 == sscanf(s.c_str(), "%lf", &x)) return x;
-	return 0;
+	struct StackEntry {
+		int node;
+		double tmin, tmax;
+	};
+	StackEntry stack[MAX_TREE_DEPTH + 2];
+	int stackSize = 0;
+	
+	double tmin, tmax;
+	if (!bbox.clipRay(ray, tmin, tmax) || tmin >= maxDist) return false;
+	tmax = min(tmax, maxDist);
+	
+	FloatRay floatRay(ray, floatOrigin);
+	const KDTreeNode* nodes = kdNodes;
+	int nodeIdx = 0;
+	while (true) {
+		const KDTreeNode& node = nodes[nodeIdx];
+		if (!node.isLeaf()) {
+			Axis axis = node.getAxis();
+			double splitPos = node.splitPos;
+			double tSplit = (splitPos - ray.start[axis]) * ray.rdir[axis];
+			bool belowFirst = ray.start[axis] < splitPos || (ray.start[axis] == splitPos && ray.dir[axis] <= 0);
+			int firstChild = node.getChildren() + (belowFirst ? 0 : 1);
+			int secondChild = node.getChildren() + (belowFirst ? 1 : 0);
+			
+			if (tSplit > tmax || tSplit <= 0) {
+				nodeIdx = firstChild;
+			} else if (tSplit < tmin) {
+				nodeIdx = secondChild;
+			} else {
+				stack[stackSize++] = StackEntry { secondChild, tSplit, tmax };
+				nodeIdx = firstChild;
+				tmax = tSplit;
+			}
+		} else {
+			const int* triIdx = kdTriangles + node.firstTriangle;
+			double gamma, lambda2, lambda3;
+			for (int n = node.getNumTriangles(); n > 0; n -= 4, triIdx += 4) {
+				int candidates = filterTriangles(floatRay, triIdx, min(n, 4), maxDist);
+				for (int i = 0; candidates; i++, candidates >>= 1)
+					if ((candidates & 1) && hitTriangle(ray, triangles[triIdx[i]], maxDist, gamma, lambda2, lambda3)
+					    && gamma < maxDist)
+						return true;
+			}
+			
+			if (stackSize == 0) return false;
+			StackEntry& entry = stack[--stackSize];
+			nodeIdx = entry.node;
+			tmin = entry.tmin;
+			tmax = entry.tmax;
+		}
+	}
 }
 
-static void parseTrio(string s, int& vertex, int& uv, int& normal)
+bool Mesh::intersectAny(const Ray& _ray, double maxDist)
 {
-	vector<string> items = split(s, '/');
-	// "4" -> {"4"} , "4//5" -> {"4", "", "5" }
+	RRay ray(_ray);
+	ray.prepareForTracing();
 	
-	vertex = toInt(items[0]);
-	uv = items.size() >= 2 ? toInt(items[1]) : 0;
-	normal = items.size() >= 3 ? toInt(items[2]) : 0;
+	return intersectKDAny(ray, maxDist);
 }
 
-static Triangle parseTriangle(string s0, string s1, string s2)
+bool Mesh::loadFromOBJ(const char* filename)
 {
-	// "3", "3/4", "3//5", "3/4/5"  (v/uv/normal)
-	Triangle T;
-	parseTrio(s0, T.v[0], T.t[0], T.n[0]);
-	parseTrio(s1, T.v[1], T.t[1], T.n[1]);
-	parseTrio(s2, T.v[2], T.t[2], T.n[2]);
-	return T;
+	int numThreads = scene.settings.numThreads ? scene.settings.numThreads : get_processor_count();
+	vector<Vector> newVertices, newNormals, newUVs;
+	vector<Triangle> newTriangles;
+	if (!loadOBJFile(filename, newVertices, newNormals, newUVs, newTriangles, numThreads)) return false;
+	meshFile.close();
+	vertices.setOwned(newVertices);
+	normals.setOwned(newNormals);
+	uvs.setOwned(newUVs);
+	triangles.setOwned(newTriangles);
+	floatTriangles.clear();
+	return true;
 }
 
-static void solve2D(Vector A, Vector B, Vector C, double& x, double& y)
+/// The header of a binary mesh file. The sections (arrays of Vector, Triangle and FloatTriangle) are at the
+/// given offsets, aligned at 16 bytes; the file is mapped in memory and the arrays are used in place.
+struct BinaryMeshHeader {
+	char magic[8];
+	int version;
+	int numVertices, numNormals, numUVs, numTriangles;
+	int reserved;
+	long long vertexOffset, normalOffset, uvOffset, triangleOffset, floatTriangleOffset;
+	long long fileSize;
+	double floatOrigin[3]; //!< the FloatTriangles are relative to that point
+};
+
+static const char BINARY_MESH_MAGIC[8] = { 'Q', 'D', 'M', 'E', 'S', 'H', 0, 0 };
+static const int BINARY_MESH_VERSION = 2;
+
+/// checks that a section of a binary mesh file is inside the file, and aligned
+static bool checkSection(const BinaryMeshHeader& header, long long offset, int count, size_t itemSize)
 {
-	// solve: x * A + y * B = C
-	double mat[2][2] = { { A.x, B.x }, { A.y, B.y } };
-	double h[2] = { C.x, C.y };
-	
-	double Dcr = mat[0][0] * mat[1][1] - mat[1][0] * mat[0][1];
-	x =         (     h[0] * mat[1][1] -      h[1] * mat[0][1]) / Dcr;
-	y =         (mat[0][0] *      h[1] - mat[1][0] *      h[0]) / Dcr;
+	return count >= 0 && offset >= (long long) sizeof(BinaryMeshHeader) && offset % 16 == 0
+		&& offset + count * (long long) itemSize <= header.fileSize;
 }
 
-bool Mesh::loadFromOBJ(const char* filename)
+/// checks that all the triangles' indices are within the vertex, normal and uv arrays
+static bool checkTriangleIndices(const Triangle* triangles, int numTriangles, int numVertices, int numNormals, int numUVs)
 {
-	FILE* f = fopen(filename, "rt");
-	
-	if (!f) return false;
-	
-	vertices.push_back(Vector(0, 0, 0));
-	uvs.push_back(Vector(0, 0, 0));
-	normals.push_back(Vector(0, 0, 0));
-	
-	char line[10000];
-	
-	while (fgets(line, sizeof(line), f)) {
-		if (line[0] == '#') continue;
-	
-		vector<string> tokens = tokenize(line); 
-		// "v 0 1    4" -> { "v", "0", "1", "4" }
-		
-		if (tokens.empty()) continue;
-		
-		if (tokens[0] == "v")
-			vertices.push_back(
-				Vector(
-					toDouble(tokens[1]),
-					toDouble(tokens[2]),
-					toDouble(tokens[3])));
-		
-		if (tokens[0] == "vn")
-			normals.push_back(
-				Vector(
-					toDouble(tokens[1]),
-					toDouble(tokens[2]),
-					toDouble(tokens[3])));
-
-		if (tokens[0] == "vt")
-			uvs.push_back(
-				Vector(
-					toDouble(tokens[1]),
-					toDouble(tokens[2]),
-					0));
-		
-		if (tokens[0] == "f") {
-			for (int i = 0; i < int(tokens.size()) - 3; i++) {
-				triangles.push_back(
-					parseTriangle(tokens[1], tokens[2 + i], tokens[3 + i])
-				);
-			}
+	for (int i = 0; i < numTriangles; i++)
+		for (int j = 0; j < 3; j++) {
+			const Triangle& T = triangles[i];
+			if (unsigned(T.v[j]) >= unsigned(numVertices) || unsigned(T.n[j]) >= unsigned(numNormals) ||
+			    unsigned(T.t[j]) >= unsigned(numUVs))
+				return false;
 		}
+	return true;
+}
+
+bool Mesh::loadBinaryMesh(const char* filename)
+{
+	if (!meshFile.open(filename)) return false;
+	const BinaryMeshHeader& header = *(const BinaryMeshHeader*) meshFile.data();
+	if (meshFile.size() < sizeof(BinaryMeshHeader) || memcmp(header.magic, BINARY_MESH_MAGIC, sizeof(header.magic)) || header.version != BINARY_MESH_VERSION ||
+	    header.fileSize != (long long) meshFile.size() ||
+	    header.numVertices < 1 || header.numNormals < 1 || header.numUVs < 1 ||
+	    !checkSection(header, header.vertexOffset, header.numVertices, sizeof(Vector)) ||
+	    !checkSection(header, header.normalOffset, header.numNormals, sizeof(Vector)) ||
+	    !checkSection(header, header.uvOffset, header.numUVs, sizeof(Vector)) ||
+	    !checkSection(header, header.triangleOffset, header.numTriangles, sizeof(Triangle)) ||
+	    !checkSection(header, header.floatTriangleOffset, header.numTriangles, sizeof(FloatTriangle)) ||
+	    // (the intersection code doesn't check the indices, so a corrupt file is rejected here, once)
+	    !checkTriangleIndices((const Triangle*) ((const char*) meshFile.data() + header.triangleOffset),
+	                          header.numTriangles, header.numVertices, header.numNormals, header.numUVs)) {
+		vertices.clear();
+		normals.clear();
+		uvs.clear();
+		triangles.clear();
+		floatTriangles.clear();
+		meshFile.close();
+		return false;
 	}
+	const char* data = (const char*) meshFile.data();
+	vertices.setExternal((const Vector*) (data + header.vertexOffset), header.numVertices);
+	normals.setExternal((const Vector*) (data + header.normalOffset), header.numNormals);
+	uvs.setExternal((const Vector*) (data + header.uvOffset), header.numUVs);
+	triangles.setExternal((const Triangle*) (data + header.triangleOffset), header.numTriangles);
+	floatTriangles.setExternal((const FloatTriangle*) (data + header.floatTriangleOffset), header.numTriangles);
+	floatOrigin = Vector(header.floatOrigin[0], header.floatOrigin[1], header.floatOrigin[2]);
+	return true;
+}
+
+bool Mesh::saveBinaryMesh(const char* filename)
+{
+	vector<FloatTriangle> floatData;
+	Vector origin;
+	computeFloatTriangles(floatData, origin);
 	
-	fclose(f);
+	BinaryMeshHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, BINARY_MESH_MAGIC, sizeof(header.magic));
+	header.version = BINARY_MESH_VERSION;
+	header.numVertices = int(vertices.size());
+	header.numNormals = int(normals.size());
+	header.numUVs = int(uvs.size());
+	header.numTriangles = int(triangles.size());
+	for (int i = 0; i < 3; i++) header.floatOrigin[i] = origin[i];
+	// lay out the sections:
+	const void* sectionData[5] = { vertices.data(), normals.data(), uvs.data(), triangles.data(), floatData.data() };
+	long long sectionSize[5] = {
+		(long long) (vertices.size() * sizeof(Vector)),
+		(long long) (normals.size() * sizeof(Vector)),
+		(long long) (uvs.size() * sizeof(Vector)),
+		(long long) (triangles.size() * sizeof(Triangle)),
+		(long long) (floatData.size() * sizeof(FloatTriangle)),
+	};
+	long long* sectionOffset[5] = { &header.vertexOffset, &header.normalOffset, &header.uvOffset,
+	                                &header.triangleOffset, &header.floatTriangleOffset };
+	long long offset = sizeof(header);
+	for (int i = 0; i < 5; i++) {
+		offset = (offset + 15) & ~15LL;
+		*sectionOffset[i] = offset;
+		offset += sectionSize[i];
+	}
+	header.fileSize = offset;
 	
-	for (auto& t: triangles) {
-		Vector A = vertices[t.v[0]];
-		Vector B = vertices[t.v[1]];
-		Vector C = vertices[t.v[2]];
-		Vector AB = B - A;
-		Vector AC = C - A;
-		t.AB = AB;
-		t.AC = AC;
-		t.gnormal = t.ABcrossAC = AB ^ AC;
-		t.gnormal.normalize();
-		
-		// (1, 0) = px * texAB + qx * texAC; (1)
-		// (0, 1) = py * texAB + qy * texAC; (2)
-		
-		Vector texA = uvs[t.t[0]];
-		Vector texB = uvs[t.t[1]];
-		Vector texC = uvs[t.t[2]];
-		
-		Vector texAB = texB - texA;
-		Vector texAC = texC - texA;
-		
-		double px, py, qx, qy;
-		solve2D(texAB, texAC, Vector(1, 0, 0), px, qx); // (1)
-		solve2D(texAB, texAC, Vector(0, 1, 0), py, qy); // (2)
-		
-		t.dNdx = px * AB + qx * AC;
-		t.dNdy = py * AB + qy * AC;
-		t.dNdx.normalize();
-		t.dNdy.normalize();
+	FILE* f = fopen(filename, "wb");
+	if (!f) return false;
+	bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+	long long written = sizeof(header);
+	static const char padding[16] = { 0 };
+	for (int i = 0; ok && i < 5; i++) {
+		ok = fwrite(padding, 1, size_t(*sectionOffset[i] - written), f) == size_t(*sectionOffset[i] - written);
+		ok = ok && (sectionSize[i] == 0 || fwrite(sectionData[i], size_t(sectionSize[i]), 1, f) == 1);
+		written = *sectionOffset[i] + sectionSize[i];
 	}
-
-	return true;
+	ok = (fclose(f) == 0) && ok;
+	if (!ok) remove(filename);
+	return ok;
 }
+
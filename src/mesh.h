@@ -25,56 +25,203 @@
 #define __MESH_H__
 
 #include <vector>
+#include <string>
 #include "geometry.h"
 #include "vector.h"
 #include "bbox.h"
+#include "util.h"
 
+/**
+ * @brief A single node of a KD tree (8 bytes).
+ *
+ * The nodes of a tree are stored in a single contiguous array (see KDTree). The two children of an
+ * inner node are always adjacent in that array, so only the index of the first is stored.
+ */
 struct KDTreeNode {
-	Axis axis; // AXIS_NONE if this is a leaf node
-	double splitPos;
+	/// bits 0..1: the split axis (AXIS_NONE if this is a leaf node).
+	/// bits 2..31: index of the first child (inner nodes), or the number of triangles (leaves)
+	unsigned flags;
 	union {
-		std::vector<int>* triangles;
-		KDTreeNode* children;
+		float splitPos;         //!< (inner nodes): where the splitting plane is
+		unsigned firstTriangle; //!< (leaves): where the leaf's triangles begin in KDTree::triangles
 	};
-	//
-	void initLeaf(const std::vector<int>& triangles)
+	
+	inline Axis getAxis() const { return (Axis) (flags & 3); }
+	inline bool isLeaf() const { return (flags & 3) == AXIS_NONE; }
+	inline int getChildren() const { return int(flags >> 2); }
+	inline int getNumTriangles() const { return int(flags >> 2); }
+	
+	void initLeaf(int firstTriangle, int numTriangles)
 	{
-		axis = AXIS_NONE;
-		this->triangles = new std::vector<int>(triangles);
+		flags = AXIS_NONE | (unsigned(numTriangles) << 2);
+		this->firstTriangle = unsigned(firstTriangle);
 	}
 	
-	void initTreeNode(Axis axis, double splitPos)
+	void initTreeNode(Axis axis, float splitPos, int children)
 	{
-		this->axis = axis;
+		flags = axis | (unsigned(children) << 2);
 		this->splitPos = splitPos;
-		this->children = new KDTreeNode[2];
 	}
-	~KDTreeNode()
+};
+
+/// A ray, prepared for Mesh::filterTriangles(): the start (relative to the mesh's float origin) and
+/// the direction are broadcast in single precision
+struct FloatRay {
+	__m128 start[3], dir[3];
+	__m128 startScale; //!< the L1 norm of start
+	__m128 dirScale;   //!< the L1 norm of dir
+	
+	FloatRay() {}
+	FloatRay(const Ray& ray, const Vector& origin)
+	{
+		Vector localStart = ray.start - origin;
+		for (int i = 0; i < 3; i++) {
+			start[i] = _mm_set1_ps(float(localStart[i]));
+			dir[i] = _mm_set1_ps(float(ray.dir[i]));
+		}
+		startScale = _mm_set1_ps(float(fabs(localStart.x) + fabs(localStart.y) + fabs(localStart.z)));
+		dirScale = _mm_set1_ps(float(fabs(ray.dir.x) + fabs(ray.dir.y) + fabs(ray.dir.z)));
+	}
+};
+
+/// The A vertex (relative to the mesh's float origin) and the AB, AC edges of a triangle, in single precision.
+/// Four of these are loaded and transposed into SoA form for testing four triangles at once (see Mesh::filterTriangles())
+struct FloatTriangle {
+	float data[12]; //!< Ax, Ay, Az, ABx | ABy, ABz, ACx, ACy | ACz, (unused) x 3
+	
+	void set(const Vector& A, const Vector& B, const Vector& C, const Vector& origin)
+	{
+		Vector AB = B - A;
+		Vector AC = C - A;
+		Vector localA = A - origin;
+		float values[12] = { float(localA.x), float(localA.y), float(localA.z), float(AB.x), float(AB.y), float(AB.z),
+		                     float(AC.x), float(AC.y), float(AC.z), 0, 0, 0 };
+		for (int i = 0; i < 12; i++) data[i] = values[i];
+	}
+};
+
+/**
+ * @brief A read-only array of mesh data, which is either owned, or points inside a memory-mapped file.
+ *
+ * The mapped data is used in place, without copying. To modify the array, take a copy(), and set it back
+ * with setOwned().
+ */
+template <typename T>
+class MeshArray {
+	std::vector<T> owned;
+	const T* ptr;
+	size_t count;
+public:
+	MeshArray(): ptr(NULL), count(0) {}
+	MeshArray(const MeshArray&) = delete;
+	MeshArray& operator = (const MeshArray&) = delete;
+	
+	size_t size() const { return count; }
+	bool empty() const { return count == 0; }
+	const T& operator [] (size_t i) const { return ptr[i]; }
+	const T* data() const { return ptr; }
+	const T* begin() const { return ptr; }
+	const T* end() const { return ptr + count; }
+	
+	/// takes over the contents of the given vector (which is left empty)
+	void setOwned(std::vector<T>& v)
+	{
+		owned.swap(v);
+		std::vector<T>().swap(v);
+		ptr = owned.data();
+		count = owned.size();
+	}
+	/// uses external data (which has to outlive the array) in place
+	void setExternal(const T* data, size_t size)
 	{
-		if (axis == AXIS_NONE)
-			delete triangles;
-		else
-			delete [] children;
+		std::vector<T>().swap(owned);
+		ptr = data;
+		count = size;
 	}
+	void clear() { setExternal(NULL, 0); }
+	std::vector<T> copy() const { return std::vector<T>(ptr, ptr + count); }
+};
+
+/// A flattened KD tree: all nodes are in one array (the root is nodes[0]), and the
+/// triangle indices of all leaves are in another.
+struct KDTree {
+	std::vector<KDTreeNode> nodes;
+	std::vector<int> triangles;
+	
+	bool empty() const { return nodes.empty(); }
+	void clear() { std::vector<KDTreeNode>().swap(nodes); std::vector<int>().swap(triangles); }
+	size_t memoryUsage() const { return nodes.size() * sizeof(KDTreeNode) + triangles.size() * sizeof(int); }
+	/// copies another tree into this one, so that the root of the subtree replaces nodes[where]
+	void graft(int where, const KDTree& subtree);
+};
+
+/// Statistics about a built KD tree (for comparing different tree builders)
+struct KDTreeStats {
+	int innerNodes, leaves, emptyLeaves, maxDepth;
+	long long leafTriangles, leafDepthSum;
+	double expectedTraversals; //!< expected # of inner nodes visited by a ray, hitting the root bbox
+	double expectedIntersections; //!< same, but # of ray-triangle tests
+	KDTreeStats() : innerNodes(0), leaves(0), emptyLeaves(0), maxDepth(0), leafTriangles(0), leafDepthSum(0),
+		expectedTraversals(0), expectedIntersections(0) {}
+	/// the total SAH cost of the tree
+	double sahCost() const;
+};
+
+/// A KD tree subtree, whose building is deferred, so that many subtrees can be built in parallel
+struct KDBuildTask {
+	int node; //!< the placeholder node in the main tree, where the subtree is to be grafted
+	BBox bbox;
+	std::vector<int> triangles;
+	int depth;
+	KDTree subtree;
 };
 
 class Mesh: public Geometry {
-	std::vector<Vector> vertices;
-	std::vector<Vector> normals;
-	std::vector<Vector> uvs;
-	std::vector<Triangle> triangles;
+	// the mesh data; either loaded from an OBJ file, or mapped from a binary mesh file (meshFile):
+	MeshArray<Vector> vertices;
+	MeshArray<Vector> normals;
+	MeshArray<Vector> uvs;
+	MeshArray<Triangle> triangles;
+	MeshArray<FloatTriangle> floatTriangles; //!< the same as triangles[], for the SIMD test
+	Vector floatOrigin; //!< the floatTriangles[] are relative to that point (the center of the mesh), to keep their precision
+	MappedFile meshFile;
 	BBox bbox;
 	
-	KDTreeNode* kdroot;
+	KDTree kdtree;
+	// the tree, used for tracing. These point either to kdtree, or inside kdCache:
+	const KDTreeNode* kdNodes;
+	const int* kdTriangles;
+	MappedFile kdCache;
+	std::string fileName; //!< the mesh file (.obj or .qdmesh)
+	bool useKDCache;      //!< save the built tree next to the OBJ file and reuse it on the next runs
 	bool useKDTree;
+	bool useSAH;
 	bool autoSmooth;
-	int maxDepthSum;
-	int numNodes;
+	int maxTreeDepth;
+	int parallelBuildDepth; //!< subtrees at this depth are deferred as separate build tasks
 
 	void computeBoundingGeometry();
-	bool intersectTriangle(const RRay& ray, const Triangle& t, IntersectionInfo& info);
-	void buildKD(KDTreeNode* node, BBox bbox, const std::vector<int>& triangleList, int depth);
-	bool intersectKD(KDTreeNode* node, const BBox& bbox, const RRay& ray, IntersectionInfo& info);
+	void computeFloatTriangles(std::vector<FloatTriangle>& result, Vector& origin) const;
+	void buildKDTree();
+	std::string kdCacheFileName() const;
+	bool loadKDCache();
+	void saveKDCache();
+	Vector faceNormal(const Triangle& t) const;
+	int filterTriangles(const FloatRay& ray, const int* triIdx, int count, double maxDist);
+	bool hitTriangle(const RRay& ray, const Triangle& t, double maxDist, double& gamma, double& lambda2, double& lambda3);
+	void fillIntersection(const Ray& ray, const Triangle& t, double gamma, double lambda2, double lambda3,
+	                      IntersectionInfo& info);
+	void buildKD(KDTree& tree, int node, BBox bbox, const std::vector<int>& triangleList, int depth,
+	             std::vector<KDBuildTask>* deferred = NULL);
+	bool findSAHSplit(const BBox& bbox, const std::vector<int>& triangleList, Axis& axis, double& splitPos);
+	void collectKDStats(int node, const BBox& bbox, int depth, KDTreeStats& stats);
+	friend class ParallelKDBuilder;
+	/// the closest hit in a leaf, which is closer than closestDist (which is updated, along with the other params)
+	bool intersectLeaf(const RRay& ray, const FloatRay& floatRay, const KDTreeNode& leaf, double& closestDist,
+	                   int& closestTriangle, double& lambda2, double& lambda3);
+	bool intersectKD(const RRay& ray, double maxDist, HitRecord& hit);
+	bool intersectKDAny(const RRay& ray, double maxDist);
+	int intersectKDPacket(const RayPacket& packet, int mask, const double maxDist[], HitRecord hits[]);
 public:
 	
 	bool faceted;
@@ -83,13 +230,30 @@ public:
 	Mesh() {
 		faceted = false;
 		useKDTree = true;
+		useKDCache = false;
+		kdNodes = NULL;
+		kdTriangles = NULL;
+		floatOrigin.makeZero();
+		useSAH = true;
 		backfaceCulling = true;
 		autoSmooth = false;
-		kdroot = NULL;
 	}
-	~Mesh();
 	
 	bool loadFromOBJ(const char* filename);
+	/// loads a binary mesh file (see saveBinaryMesh()), by mapping it in memory
+	bool loadBinaryMesh(const char* filename);
+	/**
+	 * saves the mesh in a binary file (.qdmesh), which has the vertices, normals, uvs, triangles and the
+	 * per-triangle data for the SIMD test, in the same form as in memory. These are used in place, when
+	 * the file is loaded.
+	 */
+	bool saveBinaryMesh(const char* filename);
+	/**
+	 * transforms the mesh data (before beginRender()) with the given transform, so that the mesh is in
+	 * world space, and its node needs no transform. Returns false if the mesh can't be baked (it uses
+	 * a KD tree cache, which is built in object space).
+	 */
+	bool bakeTransform(const Transform& transform);
 	
 	void fillProperties(ParsedBlock& pb)
 	{
@@ -97,7 +261,11 @@ public:
 		pb.getBoolProp("backfaceCulling", &backfaceCulling);
 		char fn[256];
 		if (pb.getFilenameProp("file", fn)) {
-			if (!loadFromOBJ(fn)) {
+			fileName = fn;
+			if (extensionUpper(fn) == "QDMESH") {
+				if (!loadBinaryMesh(fn))
+					pb.signalError("Could not load the binary mesh file!");
+			} else if (!loadFromOBJ(fn)) {
 				pb.signalError("Could not parse OBJ file!");
 			}
 			
@@ -105,12 +273,20 @@ public:
 			pb.requiredProp("file");
 		}
 		pb.getBoolProp("useKDTree", &useKDTree);
+		pb.getBoolProp("useSAH", &useSAH);
+		pb.getBoolProp("useKDCache", &useKDCache);
 		pb.getBoolProp("autoSmooth", &autoSmooth);
 	}
 	
 	void beginRender();
 	
 	bool intersect(const Ray& ray, IntersectionInfo& info);
+	bool intersectAny(const Ray& ray, double maxDist);
+	/// the hit record's primitive is the triangle index, and b1, b2 are the barycentric coordinates of the hit
+	bool findHit(const Ray& ray, double maxDist, HitRecord& hit);
+	void computeSurface(const Ray& ray, const HitRecord& hit, IntersectionInfo& info);
+	int findHitPacket(const RayPacket& packet, int mask, const double maxDist[], HitRecord hits[]);
+	bool getBBox(BBox& bbox) const { bbox = this->bbox; return true; }
 };
 
 #endif // __MESH_H__
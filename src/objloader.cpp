@@ -0,0 +1,347 @@
+/***************************************************************************
+ *   Copyright (C) 2009-2015 by Veselin Georgiev, Slavomir Kaslev et al    *
+ *   admin@raytracing-bg.net                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+/**
+ * @File objloader.cpp
+ * @Brief A fast loader for Wavefront OBJ meshes.
+ *
+ * The file is memory-mapped and parsed in place, in two passes over chunks of whole lines: the first one
+ * counts the vertices/normals/uvs/triangles in each chunk, so that the arrays can be allocated once, and each
+ * chunk knows where its data goes. The second pass parses the chunks into their places. Both passes are run in
+ * parallel for big files; the result is the same as with a sequential parse.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include "objloader.h"
+#include "util.h"
+#include "cxxptl_sdl.h"
+using std::vector;
+using std::string;
+using std::min;
+using std::max;
+
+extern ThreadPool pool; // from main.cpp
+
+static const size_t OBJ_CHUNK_SIZE = 1 << 20; // (roughly) the size of the chunks, parsed in parallel
+
+/// A range of whole lines of an OBJ file, along with the # of items in it, and where they go in the output arrays
+struct OBJChunk {
+	const char* begin;
+	const char* end;
+	int numVertices, numNormals, numUVs, numTriangles;
+	int firstVertex, firstNormal, firstUV, firstTriangle;
+};
+
+static inline bool isSpace(char c) { return c == ' ' || (c >= '\t' && c <= '\r'); }
+static inline bool isDigit(char c) { return c >= '0' && c <= '9'; }
+
+static inline const char* skipSpaces(const char* p, const char* end)
+{
+	while (p < end && *p != '\n' && isSpace(*p)) p++;
+	return p;
+}
+
+static inline const char* skipToken(const char* p, const char* end)
+{
+	while (p < end && !isSpace(*p)) p++;
+	return p;
+}
+
+static inline const char* nextLine(const char* p, const char* end)
+{
+	const char* eol = (const char*) memchr(p, '\n', end - p);
+	return eol ? eol + 1 : end;
+}
+
+/// what an OBJ statement is (identified by its first token)
+enum OBJStatement {
+	OBJ_OTHER,
+	OBJ_VERTEX,
+	OBJ_NORMAL,
+	OBJ_UV,
+	OBJ_FACE,
+};
+
+static inline OBJStatement identifyStatement(const char* p, const char* tokenEnd)
+{
+	switch (tokenEnd - p) {
+		case 1:
+			if (p[0] == 'v') return OBJ_VERTEX;
+			if (p[0] == 'f') return OBJ_FACE;
+			return OBJ_OTHER;
+		case 2:
+			if (p[0] != 'v') return OBJ_OTHER;
+			if (p[1] == 'n') return OBJ_NORMAL;
+			if (p[1] == 't') return OBJ_UV;
+			return OBJ_OTHER;
+		default:
+			return OBJ_OTHER;
+	}
+}
+
+static const double powersOf10[] = {
+	1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+/**
+ * Parses the floating-point number at the start of the token [p, tokenEnd). The result is the same as strtod()'s
+ * (zero, if there's no number): the common case (up to 15 significant digits, small exponents) is exact with
+ * just one multiplication or division, as both the mantissa and the power of 10 are exact doubles. Anything else
+ * (long mantissas, big exponents, "inf", "nan", hex...) is handled by strtod().
+ */
+static double parseDouble(const char* p, const char* tokenEnd)
+{
+	const char* start = p;
+	bool negative = false;
+	if (p < tokenEnd && (*p == '-' || *p == '+')) negative = (*p++ == '-');
+	
+	unsigned long long mantissa = 0;
+	int significantDigits = 0, exponent = 0, numDigits = 0;
+	for (; p < tokenEnd && isDigit(*p); p++, numDigits++) {
+		mantissa = mantissa * 10 + (*p - '0');
+		if (mantissa) significantDigits++;
+	}
+	if (p < tokenEnd && *p == '.') {
+		for (p++; p < tokenEnd && isDigit(*p); p++, numDigits++, exponent--) {
+			mantissa = mantissa * 10 + (*p - '0');
+			if (mantissa) significantDigits++;
+		}
+	}
+	bool exact = numDigits > 0 && significantDigits <= 15;
+	if (exact && p < tokenEnd && (*p == 'e' || *p == 'E')) {
+		p++;
+		bool negativeExp = false;
+		if (p < tokenEnd && (*p == '-' || *p == '+')) negativeExp = (*p++ == '-');
+		int exp = 0;
+		if (p == tokenEnd || !isDigit(*p)) exact = false;
+		for (; exact && p < tokenEnd && isDigit(*p); p++) {
+			exp = exp * 10 + (*p - '0');
+			if (exp > 1000) exact = false;
+		}
+		exponent += negativeExp ? -exp : exp;
+	}
+	if (exact && exponent >= -22 && exponent <= 22) {
+		double result = double(mantissa);
+		result = exponent < 0 ? result / powersOf10[-exponent] : result * powersOf10[exponent];
+		return negative ? -result : result;
+	}
+	
+	char buff[64];
+	size_t length = tokenEnd - start;
+	if (length < sizeof(buff)) {
+		memcpy(buff, start, length);
+		buff[length] = 0;
+		return strtod(buff, NULL);
+	}
+	return strtod(string(start, length).c_str(), NULL);
+}
+
+/// parses an integer at p (zero if there's no number); stops at the first non-digit
+static inline const char* parseInt(const char* p, const char* tokenEnd, int& result)
+{
+	bool negative = false;
+	if (p < tokenEnd && (*p == '-' || *p == '+')) negative = (*p++ == '-');
+	int x = 0;
+	for (; p < tokenEnd && isDigit(*p); p++) x = x * 10 + (*p - '0');
+	result = negative ? -x : x;
+	return p;
+}
+
+/// parses a face vertex: "3", "3/4", "3//5", "3/4/5"  (v/uv/normal); the missing ones are zero
+static void parseFaceVertex(const char* p, const char* tokenEnd, int& vertex, int& uv, int& normal)
+{
+	uv = normal = 0;
+	p = parseInt(p, tokenEnd, vertex);
+	p = (const char*) memchr(p, '/', tokenEnd - p);
+	if (!p) return;
+	p = parseInt(p + 1, tokenEnd, uv);
+	p = (const char*) memchr(p, '/', tokenEnd - p);
+	if (!p) return;
+	parseInt(p + 1, tokenEnd, normal);
+}
+
+/// parses up to three numbers from a v/vn/vt line (the missing ones are zero)
+static Vector parseVector(const char* p, const char* end, int count)
+{
+	double v[3] = { 0, 0, 0 };
+	for (int i = 0; i < count; i++) {
+		p = skipSpaces(p, end);
+		const char* tokenEnd = skipToken(p, end);
+		if (p == tokenEnd) break;
+		v[i] = parseDouble(p, tokenEnd);
+		p = tokenEnd;
+	}
+	return Vector(v[0], v[1], v[2]);
+}
+
+/// the first pass: count the items in the chunk
+static void countChunk(OBJChunk& chunk)
+{
+	chunk.numVertices = chunk.numNormals = chunk.numUVs = chunk.numTriangles = 0;
+	for (const char* line = chunk.begin; line < chunk.end; line = nextLine(line, chunk.end)) {
+		if (*line == '#') continue;
+		const char* p = skipSpaces(line, chunk.end);
+		const char* tokenEnd = skipToken(p, chunk.end);
+		switch (identifyStatement(p, tokenEnd)) {
+			case OBJ_VERTEX: chunk.numVertices++; break;
+			case OBJ_NORMAL: chunk.numNormals++; break;
+			case OBJ_UV:     chunk.numUVs++; break;
+			case OBJ_FACE:
+			{
+				int faceVertices = 0;
+				for (p = skipSpaces(tokenEnd, chunk.end); p < chunk.end && *p != '\n'; p = skipSpaces(p, chunk.end)) {
+					p = skipToken(p, chunk.end);
+					faceVertices++;
+				}
+				chunk.numTriangles += max(0, faceVertices - 2);
+				break;
+			}
+			default: break;
+		}
+	}
+}
+
+/// the second pass: parse the chunk into the arrays (which are already allocated)
+static void parseChunk(const OBJChunk& chunk, Vector* vertices, Vector* normals, Vector* uvs, Triangle* triangles)
+{
+	vertices += chunk.firstVertex;
+	normals += chunk.firstNormal;
+	uvs += chunk.firstUV;
+	triangles += chunk.firstTriangle;
+	for (const char* line = chunk.begin; line < chunk.end; line = nextLine(line, chunk.end)) {
+		if (*line == '#') continue;
+		const char* p = skipSpaces(line, chunk.end);
+		const char* tokenEnd = skipToken(p, chunk.end);
+		switch (identifyStatement(p, tokenEnd)) {
+			case OBJ_VERTEX: *vertices++ = parseVector(tokenEnd, chunk.end, 3); break;
+			case OBJ_NORMAL: *normals++ = parseVector(tokenEnd, chunk.end, 3); break;
+			case OBJ_UV:     *uvs++ = parseVector(tokenEnd, chunk.end, 2); break;
+			case OBJ_FACE:
+			{
+				// triangle fan: (0, 1, 2), (0, 2, 3), ...
+				Triangle T;
+				int faceVertices = 0;
+				for (p = skipSpaces(tokenEnd, chunk.end); p < chunk.end && *p != '\n'; p = skipSpaces(p, chunk.end)) {
+					tokenEnd = skipToken(p, chunk.end);
+					int slot = min(faceVertices, 2);
+					parseFaceVertex(p, tokenEnd, T.v[slot], T.t[slot], T.n[slot]);
+					if (++faceVertices >= 3) {
+						*triangles++ = T;
+						T.v[1] = T.v[2];
+						T.t[1] = T.t[2];
+						T.n[1] = T.n[2];
+					}
+					p = tokenEnd;
+				}
+				break;
+			}
+			default: break;
+		}
+	}
+}
+
+class ParallelOBJParser: public Parallel {
+	vector<OBJChunk>& chunks;
+	InterlockedInt counter;
+	bool counting; //!< true for the first pass
+	Vector *vertices, *normals, *uvs;
+	Triangle* triangles;
+public:
+	ParallelOBJParser(vector<OBJChunk>& chunks): chunks(chunks), counter(0), counting(true) {}
+	void startParsing(Vector* vertices, Vector* normals, Vector* uvs, Triangle* triangles)
+	{
+		counter.set(0);
+		counting = false;
+		this->vertices = vertices;
+		this->normals = normals;
+		this->uvs = uvs;
+		this->triangles = triangles;
+	}
+	void entry(int threadIdx, int threadCount)
+	{
+		int i;
+		while ((i = counter++) < int(chunks.size())) {
+			if (counting)
+				countChunk(chunks[i]);
+			else
+				parseChunk(chunks[i], vertices, normals, uvs, triangles);
+		}
+	}
+};
+
+bool loadOBJFile(const char* filename, vector<Vector>& vertices, vector<Vector>& normals,
+                 vector<Vector>& uvs, vector<Triangle>& triangles, int numThreads)
+{
+	vertices.assign(1, Vector(0, 0, 0));
+	normals.assign(1, Vector(0, 0, 0));
+	uvs.assign(1, Vector(0, 0, 0));
+	triangles.clear();
+	
+	MappedFile file;
+	if (!file.open(filename)) {
+		// an empty file can't be mapped, but it's a valid (empty) mesh:
+		long long size, modTime;
+		return getFileStamp(filename, size, modTime) && size == 0;
+	}
+	
+	// split the file in chunks of whole lines:
+	vector<OBJChunk> chunks;
+	const char* data = (const char*) file.data();
+	const char* end = data + file.size();
+	for (const char* p = data; p < end; ) {
+		OBJChunk chunk;
+		chunk.begin = p;
+		chunk.end = p = (size_t(end - p) > OBJ_CHUNK_SIZE) ? nextLine(p + OBJ_CHUNK_SIZE, end) : end;
+		chunks.push_back(chunk);
+	}
+	numThreads = max(1, min(numThreads, int(chunks.size())));
+	
+	ParallelOBJParser parser(chunks);
+	if (numThreads > 1)
+		pool.run(&parser, numThreads);
+	else
+		parser.entry(0, 1);
+	
+	// allocate the arrays, and give each chunk its place in them:
+	int numVertices = 1, numNormals = 1, numUVs = 1, numTriangles = 0;
+	for (auto& chunk: chunks) {
+		chunk.firstVertex = numVertices;
+		chunk.firstNormal = numNormals;
+		chunk.firstUV = numUVs;
+		chunk.firstTriangle = numTriangles;
+		numVertices += chunk.numVertices;
+		numNormals += chunk.numNormals;
+		numUVs += chunk.numUVs;
+		numTriangles += chunk.numTriangles;
+	}
+	vertices.resize(numVertices);
+	normals.resize(numNormals);
+	uvs.resize(numUVs);
+	triangles.resize(numTriangles);
+	
+	parser.startParsing(&vertices[0], &normals[0], &uvs[0], triangles.data());
+	if (numThreads > 1)
+		pool.run(&parser, numThreads);
+	else
+		parser.entry(0, 1);
+	return true;
+}
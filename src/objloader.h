@@ -0,0 +1,43 @@
+/***************************************************************************
+ *   Copyright (C) 2009-2015 by Veselin Georgiev, Slavomir Kaslev et al    *
+ *   admin@raytracing-bg.net                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+/**
+ * @File objloader.h
+ * @Brief A fast loader for Wavefront OBJ meshes.
+ */
+#ifndef __OBJLOADER_H__
+#define __OBJLOADER_H__
+
+#include <vector>
+#include "vector.h"
+#include "bbox.h"
+
+/**
+ * Loads the vertices, normals, texture coordinates and faces of an OBJ file (the other statements are ignored;
+ * faces with more than three vertices are split in a triangle fan).
+ *
+ * As the OBJ indices are 1-based, the vertices[], normals[] and uvs[] arrays get a dummy (0, 0, 0) element
+ * at index 0. Big files are parsed in parallel, on the given number of threads.
+ *
+ * @returns false if the file can't be opened.
+ */
+bool loadOBJFile(const char* filename, std::vector<Vector>& vertices, std::vector<Vector>& normals,
+                 std::vector<Vector>& uvs, std::vector<Triangle>& triangles, int numThreads);
+
+#endif // __OBJLOADER_H__
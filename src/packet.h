@@ -0,0 +1,119 @@
+/***************************************************************************
+ *   Copyright (C) 2009-2015 by Veselin Georgiev, Slavomir Kaslev et al    *
+ *   admin@raytracing-bg.net                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+/**
+ * @File packet.h
+ * @Brief Contains the RayPacket struct, used for tracing several coherent rays at once using SSE2.
+ */
+#ifndef __PACKET_H__
+#define __PACKET_H__
+
+#include <emmintrin.h>
+#include "bbox.h"
+
+/**
+ * @brief A packet of coherent rays (e.g., the primary rays through a 2x2 pixel block), traced together.
+ *
+ * Which of the rays actually take part in a query is given by a separate bitmask (bit i = rays[i]).
+ * The rays, which aren't in the mask, should still be valid (e.g., copies of the others).
+ */
+struct RayPacket {
+	enum { SIZE = 4 };
+	RRay rays[SIZE];
+	// the same data in SoA form: [axis][k] holds rays 2k and 2k+1 (SSE2 registers hold two doubles each):
+	__m128d start[3][2];
+	__m128d dir[3][2];
+	__m128d rdir[3][2];
+	
+	/// computes the reciprocal directions and the SoA data. Call after the rays are set up.
+	void prepareForTracing()
+	{
+		for (int i = 0; i < SIZE; i++)
+			rays[i].prepareForTracing();
+		for (int dim = 0; dim < 3; dim++)
+			for (int k = 0; k < 2; k++) {
+				start[dim][k] = _mm_set_pd(rays[2 * k + 1].start[dim], rays[2 * k].start[dim]);
+				dir[dim][k] = _mm_set_pd(rays[2 * k + 1].dir[dim], rays[2 * k].dir[dim]);
+				rdir[dim][k] = _mm_set_pd(rays[2 * k + 1].rdir[dim], rays[2 * k].rdir[dim]);
+			}
+	}
+	
+	/// Do the rays in the mask start from the same point and have the same direction signs?
+	/// The packet traversals rely on that; if it isn't so, the rays are traced one by one.
+	bool isCoherent(int mask) const
+	{
+		const RRay* first = NULL;
+		for (int i = 0; i < SIZE; i++) {
+			if (!(mask & (1 << i))) continue;
+			if (!first) {
+				first = &rays[i];
+				continue;
+			}
+			for (int dim = 0; dim < 3; dim++) {
+				if (rays[i].start[dim] != first->start[dim]) return false;
+				if ((rays[i].dir[dim] > 0) != (first->dir[dim] > 0)) return false;
+			}
+		}
+		return true;
+	}
+	
+	/// Clips the rays in the mask against a box (the same as BBox::clipRay(), but for all rays at once).
+	/// @returns the bitmask of rays, which hit the box no further than maxDist[i].
+	int clipBox(const BBox& box, int mask, const double maxDist[SIZE], __m128d tmin[2], __m128d tmax[2]) const
+	{
+		int result = 0;
+		for (int k = 0; k < 2; k++) {
+			__m128d lo = _mm_setzero_pd();
+			__m128d hi = _mm_set1_pd(INF);
+			for (int dim = 0; dim < 3; dim++) {
+				__m128d t0 = _mm_mul_pd(_mm_sub_pd(_mm_set1_pd(box.vmin[dim]), start[dim][k]), rdir[dim][k]);
+				__m128d t1 = _mm_mul_pd(_mm_sub_pd(_mm_set1_pd(box.vmax[dim]), start[dim][k]), rdir[dim][k]);
+				lo = _mm_max_pd(lo, _mm_min_pd(t0, t1));
+				hi = _mm_min_pd(hi, _mm_max_pd(t0, t1));
+			}
+			tmin[k] = lo;
+			tmax[k] = hi;
+			__m128d hit = _mm_and_pd(_mm_cmple_pd(lo, hi), _mm_cmple_pd(lo, _mm_loadu_pd(maxDist + 2 * k)));
+			result |= _mm_movemask_pd(hit) << (2 * k);
+		}
+		return result & mask;
+	}
+};
+
+/// returns the number of rays in a packet's mask
+inline int packetRayCount(int mask)
+{
+	int count = 0;
+	for (; mask; mask &= mask - 1) count++;
+	return count;
+}
+
+/// returns a bitmask of the rays in a packet, whose [tmin, tmax] intervals are non-empty
+inline int packetIntervalMask(const __m128d tmin[2], const __m128d tmax[2])
+{
+	return _mm_movemask_pd(_mm_cmple_pd(tmin[0], tmax[0])) | (_mm_movemask_pd(_mm_cmple_pd(tmin[1], tmax[1])) << 2);
+}
+
+/// per-element select: mask ? a : b
+inline __m128d packetSelect(__m128d mask, __m128d a, __m128d b)
+{
+	return _mm_or_pd(_mm_and_pd(mask, a), _mm_andnot_pd(mask, b));
+}
+
+#endif // __PACKET_H__
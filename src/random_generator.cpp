@@ -136,7 +136,7 @@ Random& getRandomGen()
 #include "color.h"
 #include "sdl.h"
 
-extern Color vfb[VFB_MAX_SIZE][VFB_MAX_SIZE];
+extern FrameBuffer vfb;
 
 static Random* grand;
 
@@ -189,17 +189,17 @@ static void displayCharts(double npoints)
 	for (int y = 0; y < 511; y++)
 		for (int x = 0; x < 511; x++) {
 			float f = int_buff[y][x] * 0.2f;
-			vfb[y][x] = Color(f, f, f);
+			vfb.at(x, y) = Color(f, f, f);
 	}
 	for (int y = 0; y < 511; y++)
 		for (int x = 0; x < 512; x++) {
 			float f = float_buff[y][x] * 0.2f;
-			vfb[y][x+512] = Color(f, f, f);
+			vfb.at(x+512, y) = Color(f, f, f);
 		}
 	for (int y = 0; y < 512; y++)
 		for (int x = 0; x < 511; x++) {
 			float f = circle_buff[y][x] * 0.2f;
-			vfb[y+512][x] = Color(f, f, f);
+			vfb.at(x, y+512) = Color(f, f, f);
 		}
 	const int BORDERS = 16;
 	const int NLINES = 8;
@@ -218,16 +218,17 @@ static void displayCharts(double npoints)
 			else if (y == sy) f = Color(0.9f, 0.9f, 0.9f);
 			else if (y > sy) f.makeZero();
 			else if (y > ey) f += Color(0.2f, 0.2f, 0.5f);
-			vfb[y+512][x+512] = f;
+			vfb.at(x+512, y+512) = f;
 		}
 	}
 	for (int i = 0; i < 1024; i++)
-		vfb[i][511] = vfb[511][i] = Color(1, 1, 1);
+		vfb.at(511, i) = vfb.at(i, 511) = Color(1, 1, 1);
 }
 
 void test_random()
 {
 	initGraphics(1024, 1024);
+	vfb.init(1024, 1024);
 	Random rnd(time(NULL));
 	//
 	for (int i = 0; i < 200; i++)
@@ -25,6 +25,7 @@
 #include <ctype.h>
 #include <vector>
 #include <string>
+#include <map>
 #include <string.h>
 #include <stdarg.h>
 
@@ -37,6 +38,7 @@
 #include "constants.h"
 #include "camera.h"
 #include "geometry.h"
+#include "bvh.h"
 #include "shading.h"
 #include "environment.h"
 #include "mesh.h"
@@ -45,6 +47,7 @@
 #include "mesh.h"
 #include "random_generator.h"
 #include "heightfield.h"
+#include "instances.h"
 #include "lights.h"
 #include <assert.h>
 using std::vector;
@@ -748,10 +751,24 @@ bool DefaultSceneParser::resolveFullPath(char* path)
 	}
 }
 
+/// gets the world-space boxes of the given (bounded) nodes, slightly enlarged to account for the
+/// tolerances of the intersection routines
+static void getNodeBBoxes(const vector<Node*>& nodes, vector<BBox>& boxes)
+{
+	boxes.resize(nodes.size());
+	for (int i = 0; i < (int) nodes.size(); i++) {
+		nodes[i]->getBBox(boxes[i]);
+		Vector eps = (boxes[i].vmax - boxes[i].vmin) * 1e-6 + Vector(1e-6, 1e-6, 1e-6);
+		boxes[i].vmin = boxes[i].vmin - eps;
+		boxes[i].vmax = boxes[i].vmax + eps;
+	}
+}
+
 Scene::Scene()
 {
 	environment = NULL;
 	camera = NULL;
+	bvh = NULL;
 }
 
 template<typename T>
@@ -774,6 +791,8 @@ Scene::~Scene()
 	environment = NULL;
 	if (camera) delete camera;
 	camera = NULL;
+	if (bvh) delete bvh;
+	bvh = NULL;
 }
 
 bool Scene::parseScene(const char* filename)
@@ -784,7 +803,11 @@ bool Scene::parseScene(const char* filename)
 
 void Scene::beginRender()
 {
-	for (auto& element: geometries) element->beginRender();
+	// (before the geometries' beginRender(), so that the meshes build their KD trees in world space)
+	if (settings.bakeTransforms) bakeTransforms();
+	// (the instance sets need the bounding boxes of the geometries they place, so they go last)
+	for (auto& element: geometries) if (!dynamic_cast<Instances*>(element)) element->beginRender();
+	for (auto& element: geometries) if (dynamic_cast<Instances*>(element)) element->beginRender();
 	for (auto& element: textures) element->beginRender();
 	for (auto& element: shaders) element->beginRender();
 	for (auto& element: superNodes) element->beginRender();
@@ -793,6 +816,49 @@ void Scene::beginRender()
 	camera->beginRender();
 	settings.beginRender();
 	if (environment) environment->beginRender();
+	
+	// sort the nodes into bounded and unbounded ones, and build a BVH over the former:
+	boundedNodes.clear();
+	unboundedNodes.clear();
+	for (auto& node: nodes) {
+		BBox bbox;
+		if (node->getBBox(bbox)) boundedNodes.push_back(node);
+		else unboundedNodes.push_back(node);
+	}
+	vector<BBox> boxes;
+	getNodeBBoxes(boundedNodes, boxes);
+	if (bvh) delete bvh;
+	bvh = new BVH;
+	bvh->build(boxes);
+	printf("Scene BVH: %d nodes over %d bounded scene nodes (%d unbounded)\n",
+			bvh->getNumNodes(), (int) boundedNodes.size(), (int) unboundedNodes.size());
+}
+
+void Scene::bakeTransforms()
+{
+	// count the users of each geometry; only geometries with a single node (and not a part of a CSG or
+	// an instance set) are baked:
+	std::map<Geometry*, int> users;
+	for (auto& node: nodes) users[node->geom]++;
+	for (auto& node: superNodes) users[node->geom]++;
+	for (auto& geom: geometries) {
+		CsgOp* csg = dynamic_cast<CsgOp*>(geom);
+		if (csg) {
+			users[csg->left]++;
+			users[csg->right]++;
+		}
+		Instances* instances = dynamic_cast<Instances*>(geom);
+		if (instances) users[instances->geom]++;
+	}
+	int baked = 0;
+	for (auto& node: nodes) {
+		Mesh* mesh = dynamic_cast<Mesh*>(node->geom);
+		if (!mesh || users[mesh] != 1 || !mesh->bakeTransform(node->transform)) continue;
+		node->transform.reset();
+		node->geomInWorldSpace = true;
+		baked++;
+	}
+	printf("Baked the transforms of %d mesh node(s) into world space\n", baked);
 }
 
 void Scene::beginFrame()
@@ -802,12 +868,80 @@ void Scene::beginFrame()
 	for (auto& element: shaders) element->beginFrame();
 	for (auto& element: superNodes) element->beginFrame();
 	for (auto& element: nodes) element->beginFrame();
+	if (bvh) {
+		vector<BBox> boxes;
+		getNodeBBoxes(boundedNodes, boxes);
+		bvh->refit(boxes);
+	}
 	for (auto& element: lights) element->beginFrame();
 	camera->beginFrame();
 	settings.beginFrame();
 	if (environment) environment->beginFrame();
 }
 
+Node* Scene::intersect(const Ray& ray, IntersectionInfo& closestInfo)
+{
+	// only keep a hit record while searching; the surface is computed just once, for the closest hit:
+	Node* closestNode = NULL;
+	HitRecord closestHit;
+	double closestDist = INF;
+	auto tryNode = [&] (Node* node, double& maxDist) {
+		HitRecord hit;
+		if (node->findHit(ray, maxDist, hit)) {
+			maxDist = hit.distance;
+			closestNode = node;
+			closestHit = hit;
+		}
+	};
+	for (auto& node: unboundedNodes) tryNode(node, closestDist);
+	RRay rray(ray);
+	rray.prepareForTracing();
+	bvh->traverse(rray, closestDist, [&] (int item, double& maxDist) {
+		tryNode(boundedNodes[item], maxDist);
+		return false;
+	});
+	if (closestNode) closestNode->computeSurface(ray, closestHit, closestInfo);
+	return closestNode;
+}
+
+bool Scene::intersectAny(const Ray& ray, double maxDist)
+{
+	for (auto& node: unboundedNodes)
+		if (node->intersectAny(ray, maxDist)) return true;
+	RRay rray(ray);
+	rray.prepareForTracing();
+	return bvh->traverse(rray, maxDist, [&] (int item, double& maxDist) {
+		return boundedNodes[item]->intersectAny(ray, maxDist);
+	});
+}
+
+void Scene::intersectPacket(const RayPacket& packet, int mask, Node* closestNodes[], IntersectionInfo closestInfo[])
+{
+	double closestDist[RayPacket::SIZE];
+	HitRecord closestHit[RayPacket::SIZE];
+	for (int i = 0; i < RayPacket::SIZE; i++) {
+		closestNodes[i] = NULL;
+		closestDist[i] = INF;
+	}
+	auto tryNode = [&] (Node* node, int mask) {
+		HitRecord hits[RayPacket::SIZE];
+		int found = node->findHitPacket(packet, mask, closestDist, hits);
+		for (int i = 0; i < RayPacket::SIZE; i++)
+			if (found & (1 << i)) {
+				closestDist[i] = hits[i].distance;
+				closestNodes[i] = node;
+				closestHit[i] = hits[i];
+			}
+	};
+	for (auto& node: unboundedNodes) tryNode(node, mask);
+	bvh->traversePacket(packet, mask, closestDist, [&] (int item, int mask) {
+		tryNode(boundedNodes[item], mask);
+	});
+	for (int i = 0; i < RayPacket::SIZE; i++)
+		if (closestNodes[i])
+			closestNodes[i]->computeSurface(packet.rays[i], closestHit[i], closestInfo[i]);
+}
+
 GlobalSettings::GlobalSettings()
 {
 	frameWidth = RESX;
@@ -822,6 +956,12 @@ GlobalSettings::GlobalSettings()
 	numPaths = 10;
 	numThreads = 0;
 	interactive = fullscreen = false;
+	packetTracing = true;
+	bakeTransforms = false;
+	progressive = false;
+	timeBudget = 0;
+	targetSamples = 0;
+	noiseThreshold = 0;
 }
 
 void GlobalSettings::fillProperties(ParsedBlock& pb)
@@ -839,11 +979,20 @@ void GlobalSettings::fillProperties(ParsedBlock& pb)
 	pb.getIntProp("numThreads", &numThreads, 0, 64);
 	pb.getBoolProp("interactive", &interactive);
 	pb.getBoolProp("fullscreen", &fullscreen);
+	pb.getBoolProp("packetTracing", &packetTracing);
+	pb.getBoolProp("bakeTransforms", &bakeTransforms);
+	pb.getBoolProp("progressive", &progressive);
+	pb.getDoubleProp("timeBudget", &timeBudget, 0);
+	pb.getIntProp("targetSamples", &targetSamples, 0);
+	pb.getFloatProp("noiseThreshold", &noiseThreshold, 0, 1);
+	// without any stop condition, take as many samples, as the non-progressive path tracing would:
+	if (progressive && timeBudget == 0 && targetSamples == 0 && noiseThreshold == 0)
+		targetSamples = numPaths;
 }
 
 bool GlobalSettings::needAApass()
 {
-	return wantAA && !interactive && !scene.camera->dof && !scene.settings.gi;
+	return wantAA && !interactive && !progressive && !scene.camera->dof && !scene.settings.gi;
 }
 
 SceneElement* DefaultSceneParser::newSceneElement(const char* className)
@@ -870,6 +1019,7 @@ SceneElement* DefaultSceneParser::newSceneElement(const char* className)
 	if (!strcmp(className, "BumpTexture")) return new BumpTexture;
 	if (!strcmp(className, "Bumps")) return new Bumps;
 	if (!strcmp(className, "Heightfield")) return new Heightfield;
+	if (!strcmp(className, "Instances")) return new Instances;
 	if (!strcmp(className, "Const")) return new Const;
 	if (!strcmp(className, "PointLight")) return new PointLight;
 	if (!strcmp(className, "RectLight")) return new RectLight;
@@ -51,6 +51,9 @@ class Camera;
 class Bitmap;
 class Light;
 struct Transform;
+class BVH;
+struct RayPacket;
+struct IntersectionInfo;
 
 class ParsedBlock;
 
@@ -261,6 +264,14 @@ struct GlobalSettings: public SceneElement {
 	int numThreads;              //!< # of threads for rendering; 0 = autodetect. 1 = single-threaded
 	bool interactive;            //!< interactive render
 	bool fullscreen;             //!< whether we should switch to fullscreen in interactive mode
+	bool packetTracing;          //!< trace the primary rays in 2x2 packets, where possible (defaults to true)
+	bool bakeTransforms;         //!< move meshes, used by a single node, to world space before rendering (defaults to false)
+	
+	// Progressive rendering (one sample per pixel per pass, displayed after each pass; not in interactive mode):
+	bool progressive;            //!< render progressively, until any of the conditions below is met (defaults to false)
+	double timeBudget;           //!< stop after that many seconds (0 = no limit)
+	int targetSamples;           //!< stop after that many samples per pixel (0 = no limit)
+	float noiseThreshold;        //!< stop when the average standard error of the pixels' intensity drops below that (0 = don't check)
 		
 	GlobalSettings();
 	void fillProperties(ParsedBlock& pb);
@@ -279,6 +290,9 @@ struct Scene {
 	Environment* environment;
 	Camera* camera;
 	GlobalSettings settings;
+	BVH* bvh;                         //!< a top-level acceleration structure over the (bounded) nodes
+	std::vector<Node*> boundedNodes;  //!< nodes, which are in the BVH (the item indices in it point here)
+	std::vector<Node*> unboundedNodes;//!< nodes, which can't be bounded (e.g., infinite planes); tested linearly
 	
 	Scene();
 	~Scene();
@@ -286,6 +300,15 @@ struct Scene {
 	bool parseScene(const char* sceneFile); //!< Parses a scene file and loads the scene from it. Returns true on success.
 	void beginRender(); //!< Notifies the scene so that a render is about to begin. It calls the beginRender() method of all scene elements
 	void beginFrame(); //!< Notifies the scene so that a new frame is about to begin. It calls the beginFrame() method of all scene elements
+	void bakeTransforms(); //!< Transforms the meshes, which aren't shared between nodes, to world space (see GlobalSettings::bakeTransforms)
+	
+	/// finds the closest node, intersected by the ray. Returns NULL if there's no intersection
+	Node* intersect(const Ray& ray, IntersectionInfo& closestInfo);
+	/// checks whether the ray hits any node closer than maxDist
+	bool intersectAny(const Ray& ray, double maxDist);
+	/// same as intersect(), but for the rays of a packet, given in the mask. The closest node for the i-th ray
+	/// goes to closestNodes[i] (NULL if none).
+	void intersectPacket(const RayPacket& packet, int mask, Node* closestNodes[], IntersectionInfo closestInfo[]);
 };
 
 extern Scene scene;
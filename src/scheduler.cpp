@@ -0,0 +1,166 @@
+/***************************************************************************
+ *   Copyright (C) 2009-2015 by Veselin Georgiev, Slavomir Kaslev et al    *
+ *   admin@raytracing-bg.net                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+/**
+ * @File scheduler.cpp
+ * @Brief Implementation of the work-stealing bucket scheduler.
+ */
+#include <SDL/SDL.h>
+#include <stdio.h>
+#include <algorithm>
+#include "scheduler.h"
+using std::vector;
+using std::min;
+using std::max;
+
+BucketScheduler::BucketScheduler(const vector<Rect>& buckets, int numThreads, bool costOrdered):
+	queued(0), working(0), idle(0), steals(0), splits(0), aborted(false)
+{
+	numThreads = max(1, numThreads);
+	int n = int(buckets.size());
+	for (int i = 0; i < numThreads; i++) {
+		WorkQueue* q = new WorkQueue;
+		q->working = false;
+		q->finishTime = 0;
+		if (costOrdered) {
+			// each thread gets every numThreads-th bucket, starting with the most expensive ones:
+			for (int j = i; j < n; j += numThreads) q->buckets.push_back(buckets[j]);
+		} else {
+			// each thread gets a contiguous run of the (zigzag-ordered) buckets:
+			q->buckets.assign(buckets.begin() + i * n / numThreads, buckets.begin() + (i + 1) * n / numThreads);
+		}
+		queues.push_back(q);
+	}
+	queued.set(n);
+}
+
+BucketScheduler::~BucketScheduler()
+{
+	for (auto& q: queues) delete q;
+}
+
+bool BucketScheduler::getBucket(int threadIdx, Rect& r)
+{
+	WorkQueue& q = *queues[threadIdx];
+	// (a thread counts as working while it looks for a bucket, so that every bucket is always either queued,
+	// or held by a working thread - otherwise a thread, which waits for something to steal, might give up too soon)
+	if (!q.working) working++;
+	q.working = true;
+	if (aborted) {
+		q.working = false;
+		working--;
+		q.finishTime = SDL_GetTicks();
+		return false;
+	}
+	q.lock.enter();
+	bool found = !q.buckets.empty();
+	if (found) {
+		r = q.buckets.front();
+		q.buckets.pop_front();
+		queued--;
+	}
+	q.lock.leave();
+	if (!found) {
+		idle++;
+		while (!(found = steal(threadIdx, r))) {
+			q.working = false;
+			working--;
+			if (aborted || (working.get() == 0 && queued.get() == 0)) break;
+			SDL_Delay(1);
+			q.working = true;
+			working++;
+		}
+		idle--;
+		if (!found) {
+			q.finishTime = SDL_GetTicks();
+			return false;
+		}
+	}
+	maybeSplit(threadIdx, r);
+	return true;
+}
+
+/// takes a bucket from the back of the fullest queue
+bool BucketScheduler::steal(int threadIdx, Rect& r)
+{
+	if (queued.get() == 0) return false;
+	int victim = -1;
+	size_t most = 0;
+	for (int i = 0; i < int(queues.size()); i++) {
+		if (i == threadIdx) continue;
+		queues[i]->lock.enter();
+		size_t size = queues[i]->buckets.size();
+		queues[i]->lock.leave();
+		if (size > most) {
+			most = size;
+			victim = i;
+		}
+	}
+	if (victim == -1) return false;
+	WorkQueue& q = *queues[victim];
+	q.lock.enter();
+	bool found = !q.buckets.empty();
+	if (found) {
+		r = q.buckets.back();
+		q.buckets.pop_back();
+		queued--;
+	}
+	q.lock.leave();
+	if (found) steals++;
+	return found;
+}
+
+/// near the end of the frame, splits the bucket in four: the first sub-tile is rendered now, the rest are queued
+void BucketScheduler::maybeSplit(int threadIdx, Rect& r)
+{
+	const int MIN_SPLIT_SIZE = 16;
+	if (queues.size() == 1 || r.w < MIN_SPLIT_SIZE || r.h < MIN_SPLIT_SIZE) return;
+	if (queued.get() >= int(queues.size()) && idle.get() == 0) return;
+	// (the split is at even coordinates, so that the 2x2 packets of primary rays stay whole)
+	int mx = r.x0 + ((r.w / 2) & ~1), my = r.y0 + ((r.h / 2) & ~1);
+	Rect parts[4] = {
+		Rect(r.x0, r.y0, mx, my), Rect(mx, r.y0, r.x1, my),
+		Rect(r.x0, my, mx, r.y1), Rect(mx, my, r.x1, r.y1),
+	};
+	r = parts[0];
+	WorkQueue& q = *queues[threadIdx];
+	q.lock.enter();
+	// (in front, so that this thread continues with them, while the thieves take from the back)
+	for (int i = 3; i >= 1; i--) q.buckets.push_front(parts[i]);
+	q.lock.leave();
+	queued.add(3);
+	splits++;
+}
+
+void BucketScheduler::printStats()
+{
+	// (after an abort, the threads stop at arbitrary points, so their idle times say nothing)
+	if (aborted) {
+		printf("Buckets: %d stolen, %d split; the render was aborted\n", steals.get(), splits.get());
+		return;
+	}
+	Uint32 firstIdle = 0xffffffff, lastIdle = 0;
+	for (auto& q: queues) {
+		firstIdle = min(firstIdle, q->finishTime);
+		lastIdle = max(lastIdle, q->finishTime);
+	}
+	printf("Buckets: %d stolen, %d split; the first thread went idle %.2lfs before the last one\n",
+		steals.get(), splits.get(),
+		(lastIdle - firstIdle) / 1000.0);
+}
@@ -0,0 +1,78 @@
+/***************************************************************************
+ *   Copyright (C) 2009-2015 by Veselin Georgiev, Slavomir Kaslev et al    *
+ *   admin@raytracing-bg.net                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+/**
+ * @File scheduler.h
+ * @Brief Hands out the buckets of a frame to the render threads, with work stealing.
+ */
+#ifndef __SCHEDULER_H__
+#define __SCHEDULER_H__
+
+#include <vector>
+#include <deque>
+#include "sdl.h"
+#include "cxxptl_sdl.h"
+
+/**
+ * @brief A work-stealing scheduler of the buckets (image sub-rectangles) of a frame.
+ *
+ * Each render thread has its own queue of buckets: initially a contiguous run of the bucket list (so a
+ * thread works on neighbouring buckets), or, if the buckets are ordered by cost, every N-th one (so each
+ * thread starts with the expensive ones), which it takes from the front. A thread, whose queue is empty,
+ * steals from the back of the fullest queue. Near the end of the frame (when there are fewer queued buckets
+ * than threads, or some thread is idle), a bucket is split into four sub-tiles before it's rendered; one
+ * is kept, and the rest are queued, so they can be stolen. Thus the last few buckets get spread over all
+ * the threads, instead of an expensive bucket finishing on a single core.
+ */
+class BucketScheduler {
+	struct WorkQueue {
+		Mutex lock;
+		std::deque<Rect> buckets;
+		bool working;     //!< the thread is rendering a bucket
+		Uint32 finishTime; //!< when did the thread run out of work (SDL ticks)
+	};
+	std::vector<WorkQueue*> queues;
+	InterlockedInt queued;  //!< the number of buckets in all queues
+	InterlockedInt working; //!< the number of threads, which are rendering a bucket
+	InterlockedInt idle;    //!< the number of threads, which look for something to steal
+	InterlockedInt steals, splits;
+	volatile bool aborted;
+	
+	bool steal(int threadIdx, Rect& r);
+	void maybeSplit(int threadIdx, Rect& r);
+public:
+	BucketScheduler(const std::vector<Rect>& buckets, int numThreads, bool costOrdered = false);
+	~BucketScheduler();
+	
+	/**
+	 * @brief gets the next bucket for the given thread (and marks the previous one as done)
+	 *
+	 * If there's nothing to steal at the moment, but other threads are still rendering (and may split their
+	 * buckets), it waits.
+	 * @returns false when the frame is done (or aborted)
+	 */
+	bool getBucket(int threadIdx, Rect& r);
+	/// makes all threads stop taking buckets (e.g., when the render is interrupted)
+	void abort() { aborted = true; }
+	/// prints how many buckets were stolen or split, and the time between the first and the last thread going idle
+	/// (the latter is skipped if the render was aborted)
+	void printStats();
+};
+
+#endif // __SCHEDULER_H__
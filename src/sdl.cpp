@@ -35,6 +35,8 @@ SDL_Thread *render_thread;
 SDL_mutex *render_lock;
 volatile bool rendering = false;
 bool render_async, wantToQuit = false;
+static bool headless = false;
+static int headlessWidth, headlessHeight;
 
 /// try to create a frame window with the given dimensions
 bool initGraphics(int frameWidth, int frameHeight, bool fullscreen)
@@ -54,36 +56,60 @@ bool initGraphics(int frameWidth, int frameHeight, bool fullscreen)
 	return true;
 }
 
+/// sets up the frame size for rendering without a window (batch mode)
+bool initHeadless(int frameWidth, int frameHeight)
+{
+	if (SDL_Init(SDL_INIT_TIMER) < 0) {
+		printf("Cannot initialize SDL: %s\n", SDL_GetError());
+		return false;
+	}
+	headless = true;
+	headlessWidth = frameWidth;
+	headlessHeight = frameHeight;
+	return true;
+}
+
+bool isHeadless(void)
+{
+	return headless;
+}
+
 /// closes SDL graphics
 void closeGraphics(void)
 {
+	if (headless) {
+		SDL_Quit();
+		return;
+	}
 	SDL_FreeSurface(screen);
 	SDL_DestroyMutex(render_lock);
 	SDL_Quit();
 }
 
 /// displays a VFB (virtual frame buffer) to the real framebuffer, with the necessary color clipping
-void displayVFB(Color vfb[VFB_MAX_SIZE][VFB_MAX_SIZE])
+void displayVFB(const FrameBuffer& vfb)
 {
+	if (headless) return;
 	int rs = screen->format->Rshift;
 	int gs = screen->format->Gshift;
 	int bs = screen->format->Bshift;
 	for (int y = 0; y < screen->h; y++) {
 		Uint32 *row = (Uint32*) ((Uint8*) screen->pixels + y * screen->pitch);
 		for (int x = 0; x < screen->w; x++)
-			row[x] = vfb[y][x].toRGB32(rs, gs, bs);
+			row[x] = vfb.at(x, y).toRGB32(rs, gs, bs);
 	}
 	SDL_Flip(screen);
 }
 
 /// displays pixels, set to true in the given array in yellow on the screen
-void markAApixels(bool needsAA[VFB_MAX_SIZE][VFB_MAX_SIZE])
+void markAApixels(const TiledBuffer<bool>& needsAA)
 {
+	if (headless) return;
 	Uint32 YELLOW = Color(1, 1, 0).toRGB32(screen->format->Rshift, screen->format->Gshift, screen->format->Bshift);
 	for (int y = 0; y < screen->h; y++) {
 		Uint32 *row = (Uint32*) ((Uint8*) screen->pixels + y * screen->pitch);
 		for (int x = 0; x < screen->w; x++)
-			if (needsAA[y][x]) row[x] = YELLOW;
+			if (needsAA.at(x, y)) row[x] = YELLOW;
 	}
 	SDL_Flip(screen);
 }
@@ -109,16 +135,16 @@ static void findUnusedFN(char fn[], const char* suffix)
 
 bool takeScreenshot(const char* filename)
 {
-	extern Color vfb[VFB_MAX_SIZE][VFB_MAX_SIZE]; // from main.cpp
+	extern FrameBuffer vfb; // from main.cpp
 	
 	Bitmap bmp;
 	bmp.generateEmptyImage(frameWidth(), frameHeight());
 	for (int y = 0; y < frameHeight(); y++)
 		for (int x = 0; x < frameWidth(); x++)
-			bmp.setPixel(x, y, vfb[y][x]);
+			bmp.setPixel(x, y, vfb.at(x, y));
 	bool res = bmp.saveImage(filename);
-	if (res) printf("Saved a screenshot as `%s'\n", filename);
-	else printf("Failed to take a screenshot\n");
+	if (res) printf("Saved the image as `%s'\n", filename);
+	else printf("Failed to save the image as `%s'\n", filename);
 	return res;
 }
 
@@ -181,6 +207,7 @@ void waitForUserExit(void)
 int frameWidth(void)
 {
 	if (screen) return screen->w;
+	if (headless) return headlessWidth;
 	return 0;
 }
 
@@ -188,11 +215,13 @@ int frameWidth(void)
 int frameHeight(void)
 {
 	if (screen) return screen->h;
+	if (headless) return headlessHeight;
 	return 0;
 }
 
 void setWindowCaption(const char* msg, float renderTime)
 {
+	if (headless) return;
 	if (renderTime >= 0) {
 		char message[128];
 		sprintf(message, msg, renderTime);
@@ -256,8 +285,66 @@ void Rect::clip(int W, int H)
 	h = max(0, y1 - y0);
 }
 
-std::vector<Rect> getBucketsList(void)
+/// see getBucketsList(): splits the image into buckets of about the same estimated cost
+static std::vector<Rect> getAdaptiveBucketsList(const std::vector<BlockCost>& costs)
+{
+	const int TARGET_BUCKET_SIZE = 4 * PREPASS_BLOCK_SIZE; // (in an image of uniform cost, all buckets are that large)
+	const int MAX_BUCKET_SIZE = 8 * PREPASS_BLOCK_SIZE;
+	int W = frameWidth();
+	int H = frameHeight();
+	int BW = (W + PREPASS_BLOCK_SIZE - 1) / PREPASS_BLOCK_SIZE;
+	int BH = (H + PREPASS_BLOCK_SIZE - 1) / PREPASS_BLOCK_SIZE;
+	// the cost estimate of a block mixes the measured time (which is noisy, with a single ray) and the ray count,
+	// each of them normalized, so that the whole image costs 1:
+	double totalSeconds = 0, totalRays = 0;
+	for (auto& c: costs) {
+		totalSeconds += c.seconds;
+		totalRays += c.rays;
+	}
+	std::vector<double> blockCost(BW * BH, 1.0 / (BW * BH));
+	for (int i = 0; i < BW * BH; i++)
+		if (totalSeconds > 0 && totalRays > 0)
+			blockCost[i] = 0.5 * (costs[i].seconds / totalSeconds + costs[i].rays / totalRays);
+	
+	// start with large buckets, and split them in four while they cost more than a bucket of the target size
+	// costs on average:
+	double targetCost = double(TARGET_BUCKET_SIZE * TARGET_BUCKET_SIZE) / (W * H);
+	std::vector<std::pair<double, Rect> > res;
+	std::vector<Rect> stack;
+	for (int y = (H - 1) / MAX_BUCKET_SIZE; y >= 0; y--)
+		for (int x = (W - 1) / MAX_BUCKET_SIZE; x >= 0; x--)
+			stack.push_back(Rect(x * MAX_BUCKET_SIZE, y * MAX_BUCKET_SIZE, (x + 1) * MAX_BUCKET_SIZE, (y + 1) * MAX_BUCKET_SIZE));
+	while (!stack.empty()) {
+		Rect square = stack.back();
+		stack.pop_back();
+		Rect r = square;
+		r.clip(W, H);
+		if (r.w <= 0 || r.h <= 0) continue;
+		double cost = 0;
+		for (int by = r.y0 / PREPASS_BLOCK_SIZE; by * PREPASS_BLOCK_SIZE < r.y1; by++)
+			for (int bx = r.x0 / PREPASS_BLOCK_SIZE; bx * PREPASS_BLOCK_SIZE < r.x1; bx++)
+				cost += blockCost[by * BW + bx];
+		if (cost <= targetCost || square.w <= PREPASS_BLOCK_SIZE) {
+			res.push_back(std::make_pair(cost, r));
+			continue;
+		}
+		int half = square.w / 2;
+		for (int i = 3; i >= 0; i--) {
+			int x0 = square.x0 + (i & 1) * half, y0 = square.y0 + (i >> 1) * half;
+			stack.push_back(Rect(x0, y0, x0 + half, y0 + half));
+		}
+	}
+	// the most expensive buckets go first (better load balance, and the hard regions are seen early):
+	std::stable_sort(res.begin(), res.end(),
+		[] (const std::pair<double, Rect>& a, const std::pair<double, Rect>& b) { return a.first > b.first; });
+	std::vector<Rect> buckets;
+	for (auto& item: res) buckets.push_back(item.second);
+	return buckets;
+}
+
+std::vector<Rect> getBucketsList(const std::vector<BlockCost>* costs)
 {
+	if (costs) return getAdaptiveBucketsList(*costs);
 	std::vector<Rect> res;
 	const int BUCKET_SIZE = 48;
 	int W = frameWidth();
@@ -279,6 +366,7 @@ std::vector<Rect> getBucketsList(void)
 
 bool drawRect(Rect r, const Color& c)
 {
+	if (headless) return true;
 	MutexRAII raii(render_lock);
 	
 	if (render_async && !rendering) return false;
@@ -300,8 +388,9 @@ bool drawRect(Rect r, const Color& c)
 	return true;
 }
 
-bool displayVFBRect(Rect r, Color vfb[VFB_MAX_SIZE][VFB_MAX_SIZE])
+bool displayVFBRect(Rect r, const FrameBuffer& vfb)
 {
+	if (headless) return true;
 	MutexRAII raii(render_lock);
 
 	if (render_async && !rendering) return false;
@@ -313,7 +402,7 @@ bool displayVFBRect(Rect r, Color vfb[VFB_MAX_SIZE][VFB_MAX_SIZE])
 	for (int y = r.y0; y < r.y1; y++) {
 		Uint32 *row = (Uint32*) ((Uint8*) screen->pixels + y * screen->pitch);
 		for (int x = r.x0; x < r.x1; x++)
-			row[x] = vfb[y][x].toRGB32(rs, gs, bs);
+			row[x] = vfb.at(x, y).toRGB32(rs, gs, bs);
 	}
 	SDL_UpdateRect(screen, r.x0, r.y0, r.w, r.h);
 	
@@ -322,6 +411,7 @@ bool displayVFBRect(Rect r, Color vfb[VFB_MAX_SIZE][VFB_MAX_SIZE])
 
 bool markRegion(Rect r, const Color& bracketColor)
 {
+	if (headless) return true;
 	MutexRAII raii(render_lock);
 
 	if (render_async && !rendering) return false;
@@ -27,13 +27,16 @@
 #include <vector>
 #include "color.h"
 #include "constants.h"
+#include "framebuffer.h"
 
 extern volatile bool rendering; // used in main/worker thread synchronization
 
 bool initGraphics(int frameWidth, int frameHeight, bool fullscreen = false);
+bool initHeadless(int frameWidth, int frameHeight); //!< for rendering without a window; all display functions do nothing
+bool isHeadless(void);
 void closeGraphics(void);
-void displayVFB(Color vfb[VFB_MAX_SIZE][VFB_MAX_SIZE]); //!< displays the VFB (Virtual framebuffer) to the real one.
-void markAApixels(bool needsAA[VFB_MAX_SIZE][VFB_MAX_SIZE]); //!< displays pixels, that need AA.
+void displayVFB(const FrameBuffer& vfb); //!< displays the VFB (Virtual framebuffer) to the real one.
+void markAApixels(const TiledBuffer<bool>& needsAA); //!< displays pixels, that need AA.
 void waitForUserExit(void); //!< Pause. Wait until the user closes the application
 int frameWidth(void); //!< returns the frame width (pixels)
 int frameHeight(void); //!< returns the frame height (pixels)
@@ -42,6 +45,7 @@ int frameHeight(void); //!< returns the frame height (pixels)
 void setWindowCaption(const char* msg, float renderTime = -1.0f);
 
 bool renderScene_threaded();
+bool takeScreenshot(const char* filename); //!< saves the VFB to an image file (BMP or EXR, by the extension)
 
 struct Rect {
 	int x0, y0, x1, y1, w, h;
@@ -55,8 +59,21 @@ struct Rect {
 	void clip(int maxX, int maxY); // clips the rectangle against image size
 };
 
-// generate a list of buckets (image sub-rectangles) to be rendered, in a zigzag pattern
-std::vector<Rect> getBucketsList(void);
+#define PREPASS_BLOCK_SIZE 16 //!< the coarse prepass traces a single ray per block of that size
+
+/// the cost of a block of the coarse prepass, measured while tracing its ray
+struct BlockCost {
+	double seconds;
+	int rays;     //!< the rays traced (including secondary and shadow rays)
+	int maxDepth; //!< the deepest recursion reached
+	BlockCost(): seconds(0), rays(0), maxDepth(0) {}
+};
+
+// generate a list of buckets (image sub-rectangles) to be rendered, in a zigzag pattern.
+// If the costs of the prepass blocks are given (in rows of (frameWidth() + PREPASS_BLOCK_SIZE - 1) / PREPASS_BLOCK_SIZE
+// blocks), the buckets are of variable size instead - smaller in the expensive areas of the image, and larger in
+// the cheap ones - and are ordered from the most expensive one.
+std::vector<Rect> getBucketsList(const std::vector<BlockCost>* costs = NULL);
 
 // fills a rectangle on the screen with a solid color
 // fails if the render thread is about to be killed
@@ -64,7 +81,7 @@ bool drawRect(Rect r, const Color& c);
 
 // same as displayVFB, but only updates a specific region.
 // fails if the thread has to be killed
-bool displayVFBRect(Rect r, Color vfb[VFB_MAX_SIZE][VFB_MAX_SIZE]);
+bool displayVFBRect(Rect r, const FrameBuffer& vfb);
 
 // marks a region (places four temporary green corners)
 // fails if the thread is to be killed
@@ -96,6 +96,11 @@ struct Transform {
 		return result;
 	}
 
+	/// true if the transform mirrors the space (e.g., scale(-1, 1, 1)), which flips the winding of triangles
+	bool flipsOrientation() const {
+		return determinant(transform) < 0;
+	}
+
 	Ray undoRay(const Ray& inputRay) const {
 		Ray result = inputRay;
 		result.start = undoPoint(inputRay.start);
@@ -29,6 +29,15 @@
 #include <cstring>
 #include <sys/types.h>
 #include <sys/stat.h>
+#ifdef _WIN32
+#	define WIN32_LEAN_AND_MEAN
+#	include <windows.h>
+#else
+#	include <fcntl.h>
+#	include <unistd.h>
+#	include <sys/mman.h>
+#	include <time.h>
+#endif
 
 #include <string>
 #include "util.h"
@@ -65,3 +74,128 @@ bool fileExists(const char* fn)
 	struct stat st;
 	return (0 == stat(temp, &st));
 }
+
+bool getFileStamp(const char* fn, long long& size, long long& modTime)
+{
+#ifdef _WIN32
+	WIN32_FILE_ATTRIBUTE_DATA attr;
+	if (!GetFileAttributesExA(fn, GetFileExInfoStandard, &attr)) return false;
+	size = ((long long) attr.nFileSizeHigh << 32) | attr.nFileSizeLow;
+	// (in 100ns units, since 1601)
+	modTime = (((long long) attr.ftLastWriteTime.dwHighDateTime << 32) | attr.ftLastWriteTime.dwLowDateTime) * 100;
+#else
+	struct stat st;
+	if (0 != stat(fn, &st)) return false;
+	size = (long long) st.st_size;
+#	ifdef __APPLE__
+	modTime = (long long) st.st_mtimespec.tv_sec * 1000000000LL + st.st_mtimespec.tv_nsec;
+#	else
+	modTime = (long long) st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+#	endif
+#endif
+	return true;
+}
+
+double getPreciseTime()
+{
+#ifdef _WIN32
+	LARGE_INTEGER counter, frequency;
+	QueryPerformanceCounter(&counter);
+	QueryPerformanceFrequency(&frequency);
+	return double(counter.QuadPart) / double(frequency.QuadPart);
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+}
+
+MappedFile::MappedFile()
+{
+	ptr = NULL;
+	length = 0;
+#ifdef _WIN32
+	fileHandle = mappingHandle = NULL;
+#endif
+}
+
+#ifdef _WIN32
+bool MappedFile::open(const char* fn)
+{
+	close();
+	HANDLE file = CreateFileA(fn, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) return false;
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) {
+		CloseHandle(file);
+		return false;
+	}
+	HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (!mapping) {
+		CloseHandle(file);
+		return false;
+	}
+	ptr = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (!ptr) {
+		CloseHandle(mapping);
+		CloseHandle(file);
+		return false;
+	}
+	length = size_t(fileSize.QuadPart);
+	fileHandle = file;
+	mappingHandle = mapping;
+	return true;
+}
+
+void MappedFile::discard(size_t offset, size_t size) const
+{
+	// unlocking pages, which aren't locked, removes them from the working set:
+	VirtualUnlock((char*) ptr + offset, size);
+}
+
+void MappedFile::close()
+{
+	if (!ptr) return;
+	UnmapViewOfFile(ptr);
+	CloseHandle(mappingHandle);
+	CloseHandle(fileHandle);
+	ptr = NULL;
+	length = 0;
+	fileHandle = mappingHandle = NULL;
+}
+#else
+bool MappedFile::open(const char* fn)
+{
+	close();
+	int fd = ::open(fn, O_RDONLY);
+	if (fd < 0) return false;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		::close(fd);
+		return false;
+	}
+	void* p = mmap(NULL, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd); // the mapping stays valid after the descriptor is closed
+	if (p == MAP_FAILED) return false;
+	ptr = p;
+	length = size_t(st.st_size);
+	return true;
+}
+
+void MappedFile::discard(size_t offset, size_t size) const
+{
+	size_t pageSize = size_t(sysconf(_SC_PAGESIZE));
+	size_t start = (size_t(ptr) + offset + pageSize - 1) / pageSize * pageSize;
+	size_t end = (size_t(ptr) + offset + size) / pageSize * pageSize;
+	if (start < end)
+		madvise((void*) start, end - start, MADV_DONTNEED);
+}
+
+void MappedFile::close()
+{
+	if (!ptr) return;
+	munmap(const_cast<void*>(ptr), length);
+	ptr = NULL;
+	length = 0;
+}
+#endif
@@ -53,6 +53,34 @@ public:
 };
 
 bool fileExists(const char* fn);
+/// gets the size and the last modification time (in nanoseconds, with the platform's resolution) of a file;
+/// returns false if it doesn't exist
+bool getFileStamp(const char* fn, long long& size, long long& modTime);
+/// a high-resolution timer: returns the seconds since some arbitrary point in the past
+double getPreciseTime();
+
+/// a read-only memory mapping of a whole file (RAII)
+class MappedFile {
+	const void* ptr;
+	size_t length;
+#ifdef _WIN32
+	void* fileHandle;
+	void* mappingHandle;
+#endif
+public:
+	MappedFile();
+	~MappedFile() { close(); }
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator = (const MappedFile&) = delete;
+	
+	bool open(const char* fn); //!< maps the file; returns false on error (or if the file is empty)
+	void close();
+	bool isOpen() const { return ptr != NULL; }
+	const void* data() const { return ptr; }
+	size_t size() const { return length; }
+	/// drops the (whole) pages in the given range from memory; they are read from the file again, if accessed
+	void discard(size_t offset, size_t size) const;
+};
 
 
 #endif // __UTIL_H__